@@ -2,21 +2,42 @@
 
 #include "putty.h"
 
+/*
+ * The pollwrapper used by cli_main_loop, which keeps a persistent
+ * registration for everything in uxsel. It outlives any one call to
+ * cli_main_loop, because some clients (e.g. PSFTP) call it afresh
+ * every time they want to wait for the network.
+ */
+static pollwrapper *cliloop_pw;
+
+struct uxsel_id {
+    int fd;
+};
+
 void cli_main_loop(cliloop_pw_setup_t pw_setup,
                    cliloop_pw_check_t pw_check,
                    cliloop_continue_t cont, void *ctx)
 {
     unsigned long now = GETTICKCOUNT();
 
-    int *fdlist = NULL;
-    size_t fdsize = 0;
+    if (!cliloop_pw) {
+        /*
+         * Register every fd uxsel already knows about. From now on,
+         * uxsel_input_add and uxsel_input_remove below keep the
+         * pollwrapper up to date as they change, so we don't have to
+         * walk the whole list every time round the loop.
+         */
+        int rwx, fdstate;
+        cliloop_pw = pollwrap_new();
+        for (int fd = first_fd(&fdstate, &rwx); fd >= 0;
+             fd = next_fd(&fdstate, &rwx))
+            pollwrap_set_fd_persistent(cliloop_pw, fd, rwx);
+    }
 
-    pollwrapper *pw = pollwrap_new();
+    pollwrapper *pw = cliloop_pw;
 
     while (true) {
-        int rwx;
         int ret;
-        int fdstate;
         unsigned long next;
 
         pollwrap_clear(pw);
@@ -24,29 +45,19 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
         if (!pw_setup(ctx, pw))
             break; /* our client signalled emergency exit */
 
-        /* Count the currently active fds. */
-        size_t nfds = 0;
-        for (int fd = first_fd(&fdstate, &rwx); fd >= 0;
-             fd = next_fd(&fdstate, &rwx))
-            nfds++;
-
-        /* Expand the fdlist buffer if necessary. */
-        sgrowarray(fdlist, fdsize, nfds);
-
         /*
-         * Add all currently open uxsel fds to pw, and store them in
-         * fdlist as well.
+         * Run any timers that are due before deciding how long to
+         * wait, because one of them may queue a callback, and then we
+         * mustn't block until the next timer (or network activity)
+         * before running it.
          */
-        size_t fdcount = 0;
-        for (int fd = first_fd(&fdstate, &rwx); fd >= 0;
-             fd = next_fd(&fdstate, &rwx)) {
-            fdlist[fdcount++] = fd;
-            pollwrap_add_fd_rwx(pw, fd, rwx);
-        }
+        bool timers_pending = false;
+        if (!toplevel_callback_pending())
+            timers_pending = run_timers(now, &next);
 
         if (toplevel_callback_pending()) {
             ret = pollwrap_poll_instant(pw);
-        } else if (run_timers(now, &next)) {
+        } else if (timers_pending) {
             do {
                 unsigned long then;
                 long ticks;
@@ -84,9 +95,8 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
 
         bool found_fd = (ret > 0);
 
-        for (size_t i = 0; i < fdcount; i++) {
-            int fd = fdlist[i];
-            int rwx = pollwrap_get_fd_rwx(pw, fd);
+        int fd, rwx;
+        while (pollwrap_next_ready(pw, &fd, &rwx)) {
             /*
              * We must process exceptional notifications before
              * ordinary readability ones, or we may go straight
@@ -107,9 +117,6 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
         if (!cont(ctx, found_fd, ran_callback))
             break;
     }
-
-    pollwrap_free(pw);
-    sfree(fdlist);
 }
 
 bool cliloop_no_pw_setup(void *ctx, pollwrapper *pw) { return true; }
@@ -117,9 +124,23 @@ void cliloop_no_pw_check(void *ctx, pollwrapper *pw) {}
 bool cliloop_always_continue(void *ctx, bool fd, bool cb) { return true; }
 
 /*
- * Any application using this main loop doesn't need to do anything
- * when uxsel adds or removes an fd, because we synchronously re-check
- * the current list every time we go round the main loop above.
+ * uxsel tells us about every fd it adds or removes, and we pass the
+ * change straight on to the main loop's pollwrapper, if it exists
+ * yet. (If not, cli_main_loop will pick the fd up from uxsel's own
+ * list when it first starts.)
  */
-uxsel_id *uxsel_input_add(int fd, int rwx) { return NULL; }
-void uxsel_input_remove(uxsel_id *id) { }
+uxsel_id *uxsel_input_add(int fd, int rwx)
+{
+    uxsel_id *id = snew(uxsel_id);
+    id->fd = fd;
+    if (cliloop_pw)
+        pollwrap_set_fd_persistent(cliloop_pw, fd, rwx);
+    return id;
+}
+
+void uxsel_input_remove(uxsel_id *id)
+{
+    if (cliloop_pw)
+        pollwrap_set_fd_persistent(cliloop_pw, id->fd, 0);
+    sfree(id);
+}
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include "tree234.h"
 #include "putty.h"
@@ -23,6 +24,10 @@ typedef struct FdSocket {
 
     int pending_error;
 
+    ReadSizer rs;
+    bool infd_nonblocking;             /* so we can read until drained */
+    bool frozen;
+
     Plug *plug;
 
     Socket sock;
@@ -163,9 +168,11 @@ static int fdsocket_try_send(FdSocket *fds)
 
     while (bufchain_size(&fds->pending_output_data) > 0) {
         ssize_t ret;
+        struct iovec iov[UX_MAX_IOVECS];
 
-        ptrlen data = bufchain_prefix(&fds->pending_output_data);
-        ret = write(fds->outfd, data.ptr, data.len);
+        size_t niov = bufchain_iovec(&fds->pending_output_data, 0,
+                                     iov, lenof(iov));
+        ret = writev(fds->outfd, iov, niov);
         noise_ultralight(NOISE_SOURCE_IOID, ret);
         if (ret < 0 && errno != EWOULDBLOCK) {
             if (!fds->pending_error) {
@@ -236,6 +243,7 @@ static void fdsocket_set_frozen(Socket *s, bool is_frozen)
     if (fds->infd < 0)
         return;
 
+    fds->frozen = is_frozen;
     if (is_frozen)
         uxsel_del(fds->infd);
     else
@@ -250,26 +258,43 @@ static const char *fdsocket_socket_error(Socket *s)
 static void fdsocket_select_result_input(int fd, int event)
 {
     FdSocket *fds;
-    char buf[20480];
+    ReadBudget rb;
+    char *buf;
+    size_t len;
     int retd;
-
-    if (!(fds = find234(fdsocket_by_infd, &fd, fdsocket_infd_find)))
-        return;
-
-    retd = read(fds->infd, buf, sizeof(buf));
-    if (retd > 0) {
-        plug_receive(fds->plug, 0, buf, retd);
-    } else {
-        if (retd < 0) {
-            plug_closing(fds->plug, strerror(errno), errno, 0);
+    bool more;
+
+    read_budget_start(&rb);
+    do {
+        /* Re-find each time round, in case the plug closed us. */
+        if (!(fds = find234(fdsocket_by_infd, &fd, fdsocket_infd_find)) ||
+            fds->frozen)
+            return;
+
+        len = fds->rs.size;
+        buf = read_buffer_claim(len);
+        retd = read(fds->infd, buf, len);
+        if (retd > 0) {
+            more = (read_budget_next(&rb, &fds->rs, len, retd) &&
+                    fds->infd_nonblocking);
+            plug_receive(fds->plug, 0, buf, retd);
+            read_buffer_release(buf);
         } else {
-            plug_closing(fds->plug, NULL, 0, 0);
+            read_buffer_release(buf);
+            if (retd < 0 && errno == EWOULDBLOCK)
+                return;
+            if (retd < 0) {
+                plug_closing(fds->plug, strerror(errno), errno, 0);
+            } else {
+                plug_closing(fds->plug, NULL, 0, 0);
+            }
+            del234(fdsocket_by_infd, fds);
+            uxsel_del(fds->infd);
+            close(fds->infd);
+            fds->infd = -1;
+            return;
         }
-        del234(fdsocket_by_infd, fds);
-        uxsel_del(fds->infd);
-        close(fds->infd);
-        fds->infd = -1;
-    }
+    } while (more);
 }
 
 static void fdsocket_select_result_output(int fd, int event)
@@ -328,6 +353,11 @@ Socket *make_fd_socket(int infd, int outfd, int inerrfd, Plug *plug)
     fds->outfd = outfd;
     fds->inerrfd = inerrfd;
 
+    fds->frozen = false;
+    readsizer_init(&fds->rs);
+    fds->infd_nonblocking = (infd >= 0 &&
+                             (fcntl(infd, F_GETFL) & O_NONBLOCK));
+
     bufchain_init(&fds->pending_input_data);
     bufchain_init(&fds->pending_output_data);
     psb_init(&fds->psb);
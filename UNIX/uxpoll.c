@@ -2,14 +2,63 @@
 #define _XOPEN_SOURCE
 
 #include <poll.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "putty.h"
 #include "tree234.h"
 
+#if defined HAVE_SYS_EPOLL_H && defined HAVE_EPOLL_CREATE1 && !defined NO_EPOLL
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/*
+ * A pollwrapper holds two kinds of fd. 'Transient' ones are added
+ * with pollwrap_add_fd_* and thrown away by pollwrap_clear, so the
+ * caller rebuilds them on every iteration; they live in the pollfd
+ * array, with fdtopos to find them again.
+ *
+ * 'Persistent' ones are set with pollwrap_set_fd_persistent and stay
+ * until changed. Where epoll is available they're registered with the
+ * kernel once, so that waiting costs nothing per idle fd and
+ * pollwrap_next_ready only visits the ones that actually have events.
+ * Any that epoll won't take (e.g. regular files), and all of them if
+ * there's no epoll, are kept in the 'pollonly' list and appended to
+ * the pollfd array each time we wait.
+ */
+typedef struct pollwrap_persist pollwrap_persist;
+struct pollwrap_persist {
+    unsigned char rwx;                 /* what the caller wants */
+    bool in_epoll;                     /* registered with epfd */
+    int pollonly_pos;                  /* index in pollonly[], or -1 */
+};
+
 struct pollwrapper {
     struct pollfd *fds;
     size_t nfd, fdsize;
     tree234 *fdtopos;
+
+    pollwrap_persist *persist;         /* indexed by fd */
+    size_t persistsize;
+
+    int *pollonly;
+    size_t npollonly, pollonlysize;
+
+    /* Where the pollonly fds went in fds[] on the last wait, and how
+     * many there were then */
+    size_t polled_pos, npolled;
+
+    /* Iteration state for pollwrap_next_ready */
+    size_t ready_pos;
+
+#ifdef USE_EPOLL
+    int epfd;                          /* -1 if we couldn't get one */
+    pid_t epfd_pid;                    /* process that created it */
+    size_t nepoll;                     /* fds registered with it */
+    struct epoll_event *events;
+    size_t nevents, eventsize;
+#endif
 };
 
 typedef struct pollwrap_fdtopos pollwrap_fdtopos;
@@ -31,7 +80,23 @@ pollwrapper *pollwrap_new(void)
     pw->fdsize = 16;
     pw->nfd = 0;
     pw->fds = snewn(pw->fdsize, struct pollfd);
-    pw->fdtopos = newtree234(pollwrap_fd_cmp);
+    pw->fdtopos = newbtree234(pollwrap_fd_cmp, false);
+
+    pw->persist = NULL;
+    pw->persistsize = 0;
+    pw->pollonly = NULL;
+    pw->npollonly = pw->pollonlysize = 0;
+    pw->polled_pos = pw->npolled = 0;
+    pw->ready_pos = 0;
+
+#ifdef USE_EPOLL
+    pw->epfd = epoll_create1(EPOLL_CLOEXEC);
+    pw->epfd_pid = getpid();
+    pw->nepoll = 0;
+    pw->events = NULL;
+    pw->nevents = pw->eventsize = 0;
+#endif
+
     return pw;
 }
 
@@ -40,6 +105,13 @@ void pollwrap_free(pollwrapper *pw)
     pollwrap_clear(pw);
     freetree234(pw->fdtopos);
     sfree(pw->fds);
+    sfree(pw->persist);
+    sfree(pw->pollonly);
+#ifdef USE_EPOLL
+    if (pw->epfd >= 0)
+        close(pw->epfd);
+    sfree(pw->events);
+#endif
     sfree(pw);
 }
 
@@ -98,7 +170,7 @@ void pollwrap_add_fd_events(pollwrapper *pw, int fd, int events)
 #define SELECT_W_OUT (SELECT_W_IN | POLLERR)
 #define SELECT_X_OUT (SELECT_X_IN)
 
-void pollwrap_add_fd_rwx(pollwrapper *pw, int fd, int rwx)
+static int pollwrap_rwx_to_events(int rwx)
 {
     int events = 0;
     if (rwx & SELECT_R)
@@ -107,23 +179,297 @@ void pollwrap_add_fd_rwx(pollwrapper *pw, int fd, int rwx)
         events |= SELECT_W_IN;
     if (rwx & SELECT_X)
         events |= SELECT_X_IN;
-    pollwrap_add_fd_events(pw, fd, events);
+    return events;
+}
+
+static int pollwrap_revents_to_rwx(int events, int revents)
+{
+    int rwx = 0;
+    if ((events & POLLIN) && (revents & SELECT_R_OUT))
+        rwx |= SELECT_R;
+    if ((events & POLLOUT) && (revents & SELECT_W_OUT))
+        rwx |= SELECT_W;
+    if ((events & POLLPRI) && (revents & SELECT_X_OUT))
+        rwx |= SELECT_X;
+    return rwx;
+}
+
+void pollwrap_add_fd_rwx(pollwrapper *pw, int fd, int rwx)
+{
+    pollwrap_add_fd_events(pw, fd, pollwrap_rwx_to_events(rwx));
+}
+
+static void pollwrap_pollonly_add(pollwrapper *pw, int fd)
+{
+    sgrowarray(pw->pollonly, pw->pollonlysize, pw->npollonly);
+    pw->persist[fd].pollonly_pos = pw->npollonly;
+    pw->pollonly[pw->npollonly++] = fd;
+}
+
+static void pollwrap_pollonly_del(pollwrapper *pw, int fd)
+{
+    int pos = pw->persist[fd].pollonly_pos;
+    int last = pw->pollonly[--pw->npollonly];
+    pw->pollonly[pos] = last;
+    pw->persist[last].pollonly_pos = pos;
+    pw->persist[fd].pollonly_pos = -1;
+}
+
+#ifdef USE_EPOLL
+
+static uint32_t pollwrap_rwx_to_epoll(int rwx)
+{
+    uint32_t events = 0;
+    if (rwx & SELECT_R)
+        events |= EPOLLIN;
+    if (rwx & SELECT_W)
+        events |= EPOLLOUT;
+    if (rwx & SELECT_X)
+        events |= EPOLLPRI;
+    return events;
+}
+
+static int pollwrap_epoll_to_rwx(int rwx, uint32_t events)
+{
+    int ret = 0;
+    if ((rwx & SELECT_R) && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        ret |= SELECT_R;
+    if ((rwx & SELECT_W) && (events & (EPOLLOUT | EPOLLERR)))
+        ret |= SELECT_W;
+    if ((rwx & SELECT_X) && (events & EPOLLPRI))
+        ret |= SELECT_X;
+    return ret;
+}
+
+/*
+ * Make the epoll registration for a persistent fd match what the
+ * caller now wants. Returns false if epoll won't have it, in which
+ * case the caller should poll() for it instead.
+ */
+static bool pollwrap_epoll_update(pollwrapper *pw, int fd, int rwx)
+{
+    pollwrap_persist *pp = &pw->persist[fd];
+    struct epoll_event ev;
+
+    if (pw->epfd < 0)
+        return false;
+
+    if (!rwx) {
+        if (pp->in_epoll) {
+            /* This can fail if the fd has already been closed, which
+             * will have removed it from the set anyway. */
+            epoll_ctl(pw->epfd, EPOLL_CTL_DEL, fd, NULL);
+            pp->in_epoll = false;
+            pw->nepoll--;
+        }
+        return true;
+    }
+
+    ev.events = pollwrap_rwx_to_epoll(rwx);
+    ev.data.fd = fd;
+    if (pp->in_epoll) {
+        if (epoll_ctl(pw->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+            return true;
+        /* The fd number must have been closed and reused without
+         * anyone telling us; register the new one from scratch. */
+        pp->in_epoll = false;
+        pw->nepoll--;
+    }
+    if (epoll_ctl(pw->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+        (errno != EEXIST ||
+         epoll_ctl(pw->epfd, EPOLL_CTL_MOD, fd, &ev) < 0))
+        return false;                  /* typically EPERM: not pollable */
+    pp->in_epoll = true;
+    pw->nepoll++;
+    return true;
+}
+
+/*
+ * After a fork, parent and child share the epoll instance, so changes
+ * one makes to it would silently affect the other. The first time we
+ * notice we're in a new process, we start our own.
+ */
+static void pollwrap_epoll_check_fork(pollwrapper *pw)
+{
+    if (pw->epfd < 0 || pw->epfd_pid == getpid())
+        return;
+
+    close(pw->epfd);
+    pw->epfd = epoll_create1(EPOLL_CLOEXEC);
+    pw->epfd_pid = getpid();
+    pw->nepoll = 0;
+
+    for (size_t fd = 0; fd < pw->persistsize; fd++) {
+        pollwrap_persist *pp = &pw->persist[fd];
+        bool was_in_epoll = pp->in_epoll;
+        pp->in_epoll = false;
+        if (was_in_epoll && !pollwrap_epoll_update(pw, fd, pp->rwx))
+            pollwrap_pollonly_add(pw, fd);
+    }
+}
+
+#endif /* USE_EPOLL */
+
+void pollwrap_set_fd_persistent(pollwrapper *pw, int fd, int rwx)
+{
+    pollwrap_persist *pp;
+
+    assert(fd >= 0);
+
+    if ((size_t)fd >= pw->persistsize) {
+        if (!rwx)
+            return;
+        size_t oldsize = pw->persistsize;
+        sgrowarray(pw->persist, pw->persistsize, (size_t)fd);
+        for (size_t i = oldsize; i < pw->persistsize; i++) {
+            pw->persist[i].rwx = 0;
+            pw->persist[i].in_epoll = false;
+            pw->persist[i].pollonly_pos = -1;
+        }
+    }
+
+    pp = &pw->persist[fd];
+    pp->rwx = rwx;
+
+#ifdef USE_EPOLL
+    pollwrap_epoll_check_fork(pw);
+    if (pp->pollonly_pos < 0) {
+        if (pollwrap_epoll_update(pw, fd, rwx))
+            return;
+        if (rwx)
+            pollwrap_pollonly_add(pw, fd);
+        return;
+    }
+#endif
+
+    if (rwx && pp->pollonly_pos < 0)
+        pollwrap_pollonly_add(pw, fd);
+    else if (!rwx && pp->pollonly_pos >= 0)
+        pollwrap_pollonly_del(pw, fd);
+}
+
+static int pollwrap_poll(pollwrapper *pw, int milliseconds)
+{
+    size_t nfd = pw->nfd, i;
+    int ret;
+
+    pw->ready_pos = 0;
+    pw->npolled = 0;
+
+#ifdef USE_EPOLL
+    pw->nevents = 0;
+    pollwrap_epoll_check_fork(pw);
+    if (pw->epfd >= 0) {
+        size_t want = pw->nepoll < 64 ? 64 : pw->nepoll;
+        if (pw->eventsize < want) {
+            sfree(pw->events);
+            pw->events = snewn(want, struct epoll_event);
+            pw->eventsize = want;
+        }
+
+        if (nfd == 0 && pw->npollonly == 0) {
+            /* Only epoll fds to wait for, so we can wait on epoll
+             * directly without involving poll() at all */
+            ret = epoll_wait(pw->epfd, pw->events, pw->eventsize,
+                             milliseconds);
+            if (ret > 0)
+                pw->nevents = ret;
+            return ret;
+        }
+    }
+#endif
+
+    /* Append the persistent fds we have to poll() for after the
+     * transient ones, and the epoll fd itself after those. */
+    sgrowarray(pw->fds, pw->fdsize, nfd + pw->npollonly + 1);
+    pw->polled_pos = nfd;
+    for (i = 0; i < pw->npollonly; i++) {
+        int fd = pw->pollonly[i];
+        pw->fds[nfd].fd = fd;
+        pw->fds[nfd].events = pollwrap_rwx_to_events(pw->persist[fd].rwx);
+        pw->fds[nfd].revents = 0;
+        nfd++;
+    }
+    pw->npolled = pw->npollonly;
+
+#ifdef USE_EPOLL
+    if (pw->epfd >= 0) {
+        pw->fds[nfd].fd = pw->epfd;
+        pw->fds[nfd].events = POLLIN;
+        pw->fds[nfd].revents = 0;
+        nfd++;
+    }
+#endif
+
+    ret = poll(pw->fds, nfd, milliseconds);
+
+#ifdef USE_EPOLL
+    if (ret > 0 && pw->epfd >= 0 && pw->fds[nfd - 1].revents) {
+        int nev = epoll_wait(pw->epfd, pw->events, pw->eventsize, 0);
+        ret--;                         /* don't count the epoll fd */
+        if (nev > 0) {
+            pw->nevents = nev;
+            ret += nev;
+        }
+    }
+#endif
+
+    return ret;
 }
 
 int pollwrap_poll_instant(pollwrapper *pw)
 {
-    return poll(pw->fds, pw->nfd, 0);
+    return pollwrap_poll(pw, 0);
 }
 
 int pollwrap_poll_endless(pollwrapper *pw)
 {
-    return poll(pw->fds, pw->nfd, -1);
+    return pollwrap_poll(pw, -1);
 }
 
 int pollwrap_poll_timeout(pollwrapper *pw, int milliseconds)
 {
     assert(milliseconds >= 0);
-    return poll(pw->fds, pw->nfd, milliseconds);
+    return pollwrap_poll(pw, milliseconds);
+}
+
+bool pollwrap_next_ready(pollwrapper *pw, int *fd_out, int *rwx_out)
+{
+#ifdef USE_EPOLL
+    while (pw->ready_pos < pw->nevents) {
+        struct epoll_event *ev = &pw->events[pw->ready_pos++];
+        int fd = ev->data.fd;
+        /* Look the fd up again rather than trusting the event, in
+         * case an earlier callback in this batch changed or removed
+         * it. */
+        if ((size_t)fd >= pw->persistsize || !pw->persist[fd].in_epoll)
+            continue;
+        int rwx = pollwrap_epoll_to_rwx(pw->persist[fd].rwx, ev->events);
+        if (rwx) {
+            *fd_out = fd;
+            *rwx_out = rwx;
+            return true;
+        }
+    }
+    size_t base = pw->nevents;
+#else
+    size_t base = 0;
+#endif
+
+    while (pw->ready_pos - base < pw->npolled) {
+        struct pollfd *pfd = &pw->fds[pw->polled_pos +
+                                      (pw->ready_pos++ - base)];
+        int rwx = pollwrap_revents_to_rwx(pfd->events, pfd->revents);
+        if ((size_t)pfd->fd < pw->persistsize)
+            rwx &= pw->persist[pfd->fd].rwx;
+        if (rwx) {
+            *fd_out = pfd->fd;
+            *rwx_out = rwx;
+            return true;
+        }
+    }
+
+    return false;
 }
 
 static void pollwrap_get_fd_events_revents(pollwrapper *pw, int fd,
@@ -158,12 +504,5 @@ int pollwrap_get_fd_rwx(pollwrapper *pw, int fd)
 {
     int events, revents;
     pollwrap_get_fd_events_revents(pw, fd, &events, &revents);
-    int rwx = 0;
-    if ((events & POLLIN) && (revents & SELECT_R_OUT))
-        rwx |= SELECT_R;
-    if ((events & POLLOUT) && (revents & SELECT_W_OUT))
-        rwx |= SELECT_W;
-    if ((events & POLLPRI) && (revents & SELECT_X_OUT))
-        rwx |= SELECT_X;
-    return rwx;
+    return pollwrap_revents_to_rwx(events, revents);
 }
@@ -342,6 +342,8 @@ static void show_help(FILE *fp)
           "         --ssh1-no-compression  forbid compression in SSH-1\n"
           "         --exitsignum         send buggy numeric \"exit-signal\" "
           "message\n"
+          "         --crypto-thread      encrypt and decrypt on worker "
+          "threads\n"
           "         --verbose            print event log messages to standard "
           "error\n"
           "         --sshlog FILE        write SSH packet log to FILE\n"
@@ -767,6 +769,8 @@ int main(int argc, char **argv)
             ssc.ssh1_allow_compression = false;
         } else if (longoptnoarg(arg, "--exitsignum")) {
             ssc.exit_signal_numeric = true;
+        } else if (longoptnoarg(arg, "--crypto-thread")) {
+            conf_set_bool(conf, CONF_ssh_crypto_thread, true);
         } else if (longoptarg(arg, "--sshlog", &val, &argc, &argv) ||
                    longoptarg(arg, "-sshlog", &val, &argc, &argv)) {
             Filename *logfile = filename_from_str(val);
@@ -210,7 +210,7 @@ static void uss_realpath(SftpServer *srv, SftpReplyBuilder *reply,
 
     char *inpath = mkstr(path);
     char *outpath = realpath(inpath, NULL);
-    free(inpath);
+    sfree(inpath);
 
     if (!outpath) {
         uss_error(uss, reply);
@@ -243,7 +243,7 @@ static void uss_open(SftpServer *srv, SftpReplyBuilder *reply,
 
     char *pathstr = mkstr(path);
     int fd = open(pathstr, openflags, GET_PERMISSIONS(attrs, 0777));
-    free(pathstr);
+    sfree(pathstr);
 
     if (fd < 0) {
         uss_error(uss, reply);
@@ -259,7 +259,7 @@ static void uss_opendir(SftpServer *srv, SftpReplyBuilder *reply,
 
     char *pathstr = mkstr(path);
     DIR *dp = opendir(pathstr);
-    free(pathstr);
+    sfree(pathstr);
 
     if (!dp) {
         uss_error(uss, reply);
@@ -296,7 +296,7 @@ static void uss_mkdir(SftpServer *srv, SftpReplyBuilder *reply,
 
     char *pathstr = mkstr(path);
     int status = mkdir(pathstr, GET_PERMISSIONS(attrs, 0777));
-    free(pathstr);
+    sfree(pathstr);
 
     if (status < 0) {
         uss_error(uss, reply);
@@ -311,7 +311,7 @@ static void uss_rmdir(SftpServer *srv, SftpReplyBuilder *reply, ptrlen path)
 
     char *pathstr = mkstr(path);
     int status = rmdir(pathstr);
-    free(pathstr);
+    sfree(pathstr);
 
     if (status < 0) {
         uss_error(uss, reply);
@@ -327,7 +327,7 @@ static void uss_remove(SftpServer *srv, SftpReplyBuilder *reply,
 
     char *pathstr = mkstr(path);
     int status = unlink(pathstr);
-    free(pathstr);
+    sfree(pathstr);
 
     if (status < 0) {
         uss_error(uss, reply);
@@ -343,8 +343,8 @@ static void uss_rename(SftpServer *srv, SftpReplyBuilder *reply,
 
     char *srcstr = mkstr(srcpath), *dststr = mkstr(dstpath);
     int status = rename(srcstr, dststr);
-    free(srcstr);
-    free(dststr);
+    sfree(srcstr);
+    sfree(dststr);
 
     if (status < 0) {
         uss_error(uss, reply);
@@ -386,7 +386,7 @@ static void uss_stat(SftpServer *srv, SftpReplyBuilder *reply,
 
     char *pathstr = mkstr(path);
     int status = (follow_symlinks ? stat : lstat) (pathstr, &st);
-    free(pathstr);
+    sfree(pathstr);
 
     if (status < 0) {
         uss_error(uss, reply);
@@ -459,7 +459,7 @@ static void uss_setstat(SftpServer *srv, SftpReplyBuilder *reply,
     char *pathstr = mkstr(path);
     bool success = true;
     SETSTAT_GUTS(PATH_PREFIX, pathstr, attrs, success);
-    free(pathstr);
+    sfree(pathstr);
 
     if (!success) {
         uss_error(uss, reply);
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <string.h>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -368,3 +369,49 @@ void platform_ssh_share_cleanup(const char *name)
 
     sfree(dirname);
 }
+
+int platform_ssh_share_detach(const char *name, char **logtext)
+{
+    pid_t pid;
+    int fd;
+
+    pid = fork();
+    if (pid < 0) {
+        *logtext = dupprintf("fork: %s", strerror(errno));
+        return SHARE_DETACH_FAILED;
+    }
+    if (pid > 0)
+        return SHARE_DETACH_FOREGROUND;
+
+    /*
+     * We're the background process. Leave the controlling terminal's
+     * session, and let go of the standard handles we inherited, so
+     * that a shell waiting for the original process's output to close
+     * doesn't end up waiting for us too.
+     */
+    setsid();
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2)
+            close(fd);
+    }
+
+    /*
+     * Both processes start out with the same random pool, and the
+     * same buffer of output for random_read_fast. The other one is
+     * about to exit, but reseed ours anyway so that the two diverge
+     * straight away; random_reseed throws the buffer away too.
+     */
+    {
+        unsigned char seed[8];
+        PUT_32BIT_MSB_FIRST(seed, getpid());
+        PUT_32BIT_MSB_FIRST(seed + 4, GETTICKCOUNT());
+        random_reseed(make_ptrlen(seed, sizeof(seed)));
+    }
+    noise_regular();
+
+    return SHARE_DETACH_BACKGROUND;
+}
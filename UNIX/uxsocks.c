@@ -171,6 +171,7 @@ int main(int argc, char **argv)
     psocks_cmdline(ps, argc, argv);
 
     sk_init();
+    sk_enable_io_uring();
     uxsel_init();
     psocks_start(ps);
 
@@ -0,0 +1,625 @@
+/*
+ * uxworker.c: let other threads hand work back to the main thread,
+ * and a small pool of worker threads built on top of that.
+ *
+ * Everything else in PuTTY runs on the one thread that runs the
+ * event loop. A thread that wants to get something done there calls
+ * queue_toplevel_callback_from_thread. That pushes the callback on a
+ * lock-free stack, and the main thread collects it when woken through
+ * a self-pipe registered with uxsel. Collected callbacks go on the
+ * ordinary toplevel callback queue, in the order they were posted,
+ * so delete_callbacks_for_context works on them as usual.
+ *
+ * The worker pool runs a job function on one of its threads and
+ * then posts a 'done' callback with the same context back to the
+ * main thread. Threads are started as they're needed, up to a limit.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "putty.h"
+
+struct xthread_cb {
+    toplevel_callback_fn_t fn;
+    void *ctx;
+    struct xthread_cb *next;
+};
+
+/*
+ * Callbacks posted by other threads, most recent first. Any thread
+ * may push; only the main thread takes things off, and it always
+ * takes the whole stack at once, so there is no ABA problem.
+ */
+static _Atomic(struct xthread_cb *) xthread_stack;
+
+static bool xthread_initialised;
+static int xthread_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t xthread_forked;
+
+struct worker_job {
+    toplevel_callback_fn_t run;
+    toplevel_callback_fn_t done;
+    void *ctx;
+    struct worker_job *next;
+};
+
+#define MAX_WORKERS 8
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_finished = PTHREAD_COND_INITIALIZER;
+static struct worker_job *jobhead, *jobtail;
+static void *running[MAX_WORKERS];     /* ctx of each thread's job */
+static int njobs, nworkers, nidle, maxworkers;
+
+static void xthread_check_fork(void);
+
+static void xthread_deliver(void)
+{
+    struct xthread_cb *list, *rev = NULL, *cb;
+
+    list = atomic_exchange(&xthread_stack, NULL);
+
+    /* Reverse the stack to get the callbacks in the order posted */
+    while (list) {
+        cb = list;
+        list = cb->next;
+        cb->next = rev;
+        rev = cb;
+    }
+
+    while ((cb = rev) != NULL) {
+        rev = cb->next;
+        queue_toplevel_callback(cb->fn, cb->ctx);
+        sfree(cb);
+    }
+}
+
+static void xthread_select_result(int fd, int event)
+{
+    char buf[64];
+
+    xthread_check_fork();
+
+    /*
+     * Empty the pipe before taking the stack, so that anything
+     * posted after we take it writes to the pipe again.
+     */
+    while (read(xthread_pipe[0], buf, sizeof(buf)) > 0);
+    xthread_deliver();
+}
+
+static void xthread_make_pipe(void)
+{
+    if (pipe(xthread_pipe) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    for (int i = 0; i < 2; i++) {
+        cloexec(xthread_pipe[i]);
+        nonblock(xthread_pipe[i]);
+    }
+    uxsel_set(xthread_pipe[0], SELECT_R, xthread_select_result);
+}
+
+static void xthread_wake(void)
+{
+    /*
+     * The pipe only needs one byte in it to wake the main thread, so
+     * a full pipe (EAGAIN) is fine.
+     */
+    char c = 0;
+    while (write(xthread_pipe[1], &c, 1) < 0 && errno == EINTR);
+}
+
+void queue_toplevel_callback_from_thread(toplevel_callback_fn_t fn,
+                                         void *ctx)
+{
+    struct xthread_cb *cb = snew(struct xthread_cb);
+    struct xthread_cb *head = atomic_load(&xthread_stack);
+
+    assert(xthread_initialised);
+    cb->fn = fn;
+    cb->ctx = ctx;
+    do {
+        cb->next = head;
+    } while (!atomic_compare_exchange_weak(&xthread_stack, &head, cb));
+
+    /* Only the post that makes the stack non-empty needs to wake us */
+    if (!head)
+        xthread_wake();
+}
+
+/* ----------------------------------------------------------------------
+ * The worker pool.
+ */
+
+static void *worker_thread(void *vindex)
+{
+    int index = (int)(intptr_t)vindex;
+    struct worker_job *job;
+
+    pthread_mutex_lock(&pool_lock);
+    while (true) {
+        while (!jobhead) {
+            nidle++;
+            pthread_cond_wait(&pool_work, &pool_lock);
+            nidle--;
+        }
+
+        job = jobhead;
+        jobhead = job->next;
+        if (!jobhead)
+            jobtail = NULL;
+        njobs--;
+        running[index] = job->ctx;
+        pthread_mutex_unlock(&pool_lock);
+
+        job->run(job->ctx);
+        queue_toplevel_callback_from_thread(job->done, job->ctx);
+        sfree(job);
+
+        pthread_mutex_lock(&pool_lock);
+        running[index] = NULL;
+        pthread_cond_broadcast(&pool_finished);
+    }
+    return NULL;
+}
+
+/* Called with pool_lock held */
+static void worker_start_if_needed(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all, old;
+
+    if (njobs <= nidle || nworkers >= maxworkers)
+        return;
+
+    /*
+     * Workers must never take a signal: the main loop relies on
+     * them interrupting its own poll() instead.
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, worker_thread,
+                       (void *)(intptr_t)nworkers) == 0)
+        nworkers++;
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* If we couldn't start even one, there's nobody to run the job */
+    if (nworkers == 0) {
+        fprintf(stderr, "Unable to start a worker thread\n");
+        exit(1);
+    }
+}
+
+void worker_submit(toplevel_callback_fn_t run, toplevel_callback_fn_t done,
+                   void *ctx)
+{
+    struct worker_job *job = snew(struct worker_job);
+
+    cross_thread_callbacks_init();
+
+    job->run = run;
+    job->done = done;
+    job->ctx = ctx;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (jobtail)
+        jobtail->next = job;
+    else
+        jobhead = job;
+    jobtail = job;
+    njobs++;
+    worker_start_if_needed();
+    pthread_cond_signal(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void worker_cancel_for_context(void *ctx)
+{
+    struct worker_job **p, *job;
+    bool busy;
+
+    if (!xthread_initialised)
+        return;
+    xthread_check_fork();
+
+    pthread_mutex_lock(&pool_lock);
+
+    /* Jobs that haven't started yet are just thrown away */
+    jobtail = NULL;
+    for (p = &jobhead; (job = *p) != NULL;) {
+        if (job->ctx == ctx) {
+            *p = job->next;
+            njobs--;
+            sfree(job);
+        } else {
+            jobtail = job;
+            p = &job->next;
+        }
+    }
+
+    /* Jobs that have, we have to wait for */
+    do {
+        busy = false;
+        for (int i = 0; i < nworkers; i++)
+            if (running[i] == ctx)
+                busy = true;
+        if (busy)
+            pthread_cond_wait(&pool_finished, &pool_lock);
+    } while (busy);
+
+    pthread_mutex_unlock(&pool_lock);
+
+    /*
+     * Now any completion for ctx has been posted. Pick it up, and
+     * drop it along with anything else queued for ctx.
+     */
+    xthread_deliver();
+    delete_callbacks_for_context(ctx);
+}
+
+/* ----------------------------------------------------------------------
+ * Setup, and recovering after fork().
+ */
+
+static void pool_atfork_prepare(void)
+{
+    pthread_mutex_lock(&pool_lock);
+}
+
+static void pool_atfork_parent(void)
+{
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void pool_atfork_child(void)
+{
+    pthread_mutex_unlock(&pool_lock);
+    xthread_forked = true;
+}
+
+/*
+ * A child process has none of its parent's worker threads, and
+ * shares the parent's wakeup pipe. So it makes its own pipe, and
+ * forgets about the parent's threads. Jobs they were in the middle
+ * of are lost, but jobs still queued are run by new threads.
+ */
+static void xthread_check_fork(void)
+{
+    if (!xthread_forked)
+        return;
+    xthread_forked = false;
+
+    uxsel_del(xthread_pipe[0]);
+    close(xthread_pipe[0]);
+    close(xthread_pipe[1]);
+    xthread_make_pipe();
+    if (atomic_load(&xthread_stack))
+        xthread_wake();
+
+    pthread_mutex_lock(&pool_lock);
+    nworkers = nidle = 0;
+    memset(running, 0, sizeof(running));
+    pthread_cond_init(&pool_work, NULL);
+    pthread_cond_init(&pool_finished, NULL);
+    if (jobhead)
+        worker_start_if_needed();
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void cross_thread_callbacks_init(void)
+{
+    long ncpus;
+
+    if (xthread_initialised) {
+        xthread_check_fork();
+        return;
+    }
+    xthread_initialised = true;
+
+    xthread_make_pipe();
+    pthread_atfork(pool_atfork_prepare, pool_atfork_parent,
+                   pool_atfork_child);
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    maxworkers = ncpus < 1 ? 1 : ncpus > MAX_WORKERS ? MAX_WORKERS : ncpus;
+}
+
+#ifdef TEST_UXWORKER
+
+/*
+ * Test code for the cross-thread callbacks and the worker pool, run
+ * on a minimal event loop of its own. It checks that callbacks posted
+ * by several threads at once all arrive on the main thread, exactly
+ * once each and in order from each thread; that every job runs off
+ * the main thread and then has its 'done' callback run on it; that
+ * after worker_cancel_for_context returns nothing more happens for
+ * that context, even if its job was already running; and that a
+ * child made by fork() can still use the pool.
+ *
+ *   cc -DTEST_UXWORKER -I. -Iunix -Icharset -o testworker \
+ *      unix/uxworker.c unix/uxsel.c unix/uxmisc.c callback.c memory.c \
+ *      utils.c marshal.c tree234.c -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+void out_of_memory(void) { fprintf(stderr, "out of memory\n"); exit(1); }
+void noise_ultralight(NoiseSourceId id, unsigned long data) {}
+uxsel_id *uxsel_input_add(int fd, int rwx) { return NULL; }
+void uxsel_input_remove(uxsel_id *id) {}
+
+static pthread_t main_thread;
+static int fails;
+
+#define FAIL(...) do { printf(__VA_ARGS__); fails++; } while (0)
+
+/*
+ * Run the event loop until *done is true, or for ten seconds.
+ */
+static void run_until(bool *done)
+{
+    time_t start = time(NULL);
+
+    while (!*done) {
+        struct pollfd pfds[16];
+        int npfds = 0, state, rwx;
+
+        if (time(NULL) - start > 10) {
+            FAIL("timed out\n");
+            return;
+        }
+        if (run_toplevel_callbacks())
+            continue;
+
+        for (int fd = first_fd(&state, &rwx); fd >= 0 && npfds < 16;
+             fd = next_fd(&state, &rwx)) {
+            pfds[npfds].fd = fd;
+            pfds[npfds].events = (rwx & SELECT_R) ? POLLIN : 0;
+            pfds[npfds].revents = 0;
+            npfds++;
+        }
+        if (poll(pfds, npfds, 1000) < 0)
+            continue;
+        for (int i = 0; i < npfds; i++)
+            if (pfds[i].revents)
+                select_result(pfds[i].fd, SELECT_R);
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Many threads posting callbacks at once.
+ */
+
+struct producer {
+    int index;
+    unsigned long count, received;
+    pthread_t thread;
+};
+static struct producer *producers;
+static unsigned long total_expected, total_received;
+static bool all_received;
+
+static void posted_cb(void *ctx)
+{
+    struct producer *p = (struct producer *)ctx;
+
+    if (!pthread_equal(pthread_self(), main_thread))
+        FAIL("posted callback ran off the main thread\n");
+    p->received++;
+    if (++total_received == total_expected)
+        all_received = true;
+}
+
+static void *producer_thread(void *ctx)
+{
+    struct producer *p = (struct producer *)ctx;
+
+    for (unsigned long i = 0; i < p->count; i++)
+        queue_toplevel_callback_from_thread(posted_cb, p);
+    return NULL;
+}
+
+/*
+ * Order within a thread is checked by a second kind of callback
+ * whose context is a sequence number for that thread.
+ */
+struct seqpost {
+    int thread;
+    unsigned long seq;
+};
+static unsigned long *next_seq;
+static int nseqdone, nseqthreads;
+static bool seq_done;
+
+static void seq_cb(void *ctx)
+{
+    struct seqpost *sp = (struct seqpost *)ctx;
+
+    if (sp->seq != next_seq[sp->thread])
+        FAIL("thread %d: got callback %lu, expected %lu\n",
+             sp->thread, sp->seq, next_seq[sp->thread]);
+    next_seq[sp->thread] = sp->seq + 1;
+    if (sp->seq == 999 && ++nseqdone == nseqthreads)
+        seq_done = true;
+}
+
+static void *seq_thread(void *ctx)
+{
+    struct seqpost *posts = (struct seqpost *)ctx;
+
+    for (int i = 0; i < 1000; i++)
+        queue_toplevel_callback_from_thread(seq_cb, &posts[i]);
+    return NULL;
+}
+
+static void test_posting(int nthreads, unsigned long n)
+{
+    struct seqpost *posts = snewn(nthreads * 1000, struct seqpost);
+    pthread_t *threads = snewn(nthreads, pthread_t);
+
+    nseqthreads = nthreads;
+    next_seq = snewn(nthreads, unsigned long);
+    memset(next_seq, 0, nthreads * sizeof(*next_seq));
+    for (int t = 0; t < nthreads; t++) {
+        for (int i = 0; i < 1000; i++) {
+            posts[t * 1000 + i].thread = t;
+            posts[t * 1000 + i].seq = i;
+        }
+        pthread_create(&threads[t], NULL, seq_thread, &posts[t * 1000]);
+    }
+    run_until(&seq_done);
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+    sfree(threads);
+    sfree(next_seq);
+    sfree(posts);
+
+    producers = snewn(nthreads, struct producer);
+    total_expected = (unsigned long)nthreads * n;
+    for (int t = 0; t < nthreads; t++) {
+        producers[t].index = t;
+        producers[t].count = n;
+        producers[t].received = 0;
+        pthread_create(&producers[t].thread, NULL, producer_thread,
+                       &producers[t]);
+    }
+    run_until(&all_received);
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(producers[t].thread, NULL);
+        if (producers[t].received != n)
+            FAIL("thread %d: %lu callbacks arrived, expected %lu\n",
+                 t, producers[t].received, n);
+    }
+    if (toplevel_callback_pending())
+        FAIL("extra callbacks arrived\n");
+    sfree(producers);
+}
+
+/* ----------------------------------------------------------------------
+ * The worker pool.
+ */
+
+struct job {
+    bool ran, done, cancelled;
+    unsigned long spin;
+    int *outstanding;
+    bool *finished;
+};
+
+static void job_run(void *ctx)
+{
+    struct job *j = (struct job *)ctx;
+    volatile unsigned long x = 0;
+
+    if (pthread_equal(pthread_self(), main_thread))
+        FAIL("job ran on the main thread\n");
+    for (unsigned long i = 0; i < j->spin; i++)
+        x += i;
+    j->ran = true;
+}
+
+static void job_done(void *ctx)
+{
+    struct job *j = (struct job *)ctx;
+
+    if (!pthread_equal(pthread_self(), main_thread))
+        FAIL("job completion ran off the main thread\n");
+    if (!j->ran)
+        FAIL("job completion ran before the job\n");
+    if (j->cancelled)
+        FAIL("completion of a cancelled job ran\n");
+    if (j->done)
+        FAIL("job completed twice\n");
+    j->done = true;
+    if (--*j->outstanding == 0)
+        *j->finished = true;
+}
+
+static void test_pool(void)
+{
+    enum { NJOBS = 2000 };
+    struct job *jobs = snewn(NJOBS, struct job);
+    int outstanding = 0;
+    bool finished = false;
+
+    /* Jobs of varying length, with every third one cancelled */
+    memset(jobs, 0, NJOBS * sizeof(*jobs));
+    for (int i = 0; i < NJOBS; i++) {
+        jobs[i].spin = (i % 7) * 20000;
+        jobs[i].outstanding = &outstanding;
+        jobs[i].finished = &finished;
+        worker_submit(job_run, job_done, &jobs[i]);
+        outstanding++;
+    }
+    for (int i = 0; i < NJOBS; i += 3) {
+        worker_cancel_for_context(&jobs[i]);
+        jobs[i].cancelled = true;
+        outstanding--;
+    }
+    run_until(&finished);
+    for (int i = 0; i < NJOBS; i++)
+        if (!jobs[i].cancelled && !jobs[i].done)
+            FAIL("job %d never completed\n", i);
+
+    sfree(jobs);
+}
+
+static void test_fork(void)
+{
+    pid_t pid = fork();
+    int status;
+
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        struct job j;
+        int outstanding = 1;
+        bool finished = false;
+
+        memset(&j, 0, sizeof(j));
+        j.outstanding = &outstanding;
+        j.finished = &finished;
+        worker_submit(job_run, job_done, &j);
+        run_until(&finished);
+        _exit(fails ? 1 : 0);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+        FAIL("worker pool failed in a child process\n");
+}
+
+int main(void)
+{
+    main_thread = pthread_self();
+    uxsel_init();
+    cross_thread_callbacks_init();
+
+    test_posting(4, 20000);
+    test_pool();
+    test_fork();
+
+    printf("%s\n", fails ? "tests failed" : "all tests passed");
+    return fails != 0 ? 1 : 0;
+}
+
+#endif
@@ -144,6 +144,14 @@ void platform_ssh_share_cleanup(const char *name)
 {
 }
 
+int platform_ssh_share_detach(const char *name, char **logtext)
+{
+    /* Windows has no fork(), and the upstream's sockets and named
+     * pipe can't be handed to a new process without it. */
+    *logtext = dupstr("not supported on Windows");
+    return SHARE_DETACH_FAILED;
+}
+
 #else /* !defined NO_SECURITY */
 
 #include "noshare.c"
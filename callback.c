@@ -1,20 +1,42 @@
 /*
- * Facility for queueing callback functions to be run from the
- * top-level event loop after the current top-level activity finishes.
+ * Facility for queueing callbacks to be run from the top-level
+ * event loop once the current top-level activity has finished.
+ *
+ * The queue is a doubly linked list, kept in the order callbacks
+ * were queued. Its nodes come from a free list, so once the queue
+ * has reached its usual size, queueing and running callbacks does
+ * not allocate. Every queued node is also on a chain in a hash table
+ * keyed by the context it belongs to. delete_callbacks_for_context
+ * can therefore find that context's callbacks without walking the
+ * whole queue. That matters when a lot of channels or connections
+ * close at once.
  */
 
 #include <stddef.h>
+#include <string.h>
 
 #include "putty.h"
 
 struct callback {
-    struct callback *next;
+    struct callback *next, *prev;      /* run queue, or free list */
+    struct callback *hnext, **hprevp;  /* hash chain for 'owner' */
 
     toplevel_callback_fn_t fn;
     void *ctx;
+
+    /*
+     * The context delete_callbacks_for_context will look for. It is
+     * the same as ctx, except for an idempotent callback, which
+     * belongs to the context of its IdempotentCallback.
+     */
+    void *owner;
 };
 
 static struct callback *cbcurr = NULL, *cbhead = NULL, *cbtail = NULL;
+static struct callback *cbfree = NULL;
+
+static struct callback **cbhash = NULL;
+static size_t cbhash_size = 0, nqueued = 0;
 
 static toplevel_callback_notify_fn_t notify_frontend = NULL;
 static void *notify_ctx = NULL;
@@ -26,56 +48,94 @@ void request_callback_notifications(toplevel_callback_notify_fn_t fn,
     notify_ctx = ctx;
 }
 
-static void run_idempotent_callback(void *ctx)
+static size_t owner_hash(void *owner)
 {
-    struct IdempotentCallback *ic = (struct IdempotentCallback *)ctx;
-    ic->queued = false;
-    ic->fn(ic->ctx);
+    uint64_t h = (uint64_t)(uintptr_t)owner * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (cbhash_size - 1);
 }
 
-void queue_idempotent_callback(struct IdempotentCallback *ic)
+static void hash_add(struct callback *cb)
 {
-    if (ic->queued)
-        return;
-    ic->queued = true;
-    queue_toplevel_callback(run_idempotent_callback, ic);
+    struct callback **bucket = &cbhash[owner_hash(cb->owner)];
+
+    cb->hnext = *bucket;
+    if (cb->hnext)
+        cb->hnext->hprevp = &cb->hnext;
+    cb->hprevp = bucket;
+    *bucket = cb;
 }
 
-void delete_callbacks_for_context(void *ctx)
+static void hash_remove(struct callback *cb)
+{
+    *cb->hprevp = cb->hnext;
+    if (cb->hnext)
+        cb->hnext->hprevp = cb->hprevp;
+}
+
+static void hash_grow(void)
 {
-    struct callback *newhead, *newtail;
-
-    newhead = newtail = NULL;
-    while (cbhead) {
-        struct callback *cb = cbhead;
-        cbhead = cbhead->next;
-        if (cb->ctx == ctx ||
-            (cb->fn == run_idempotent_callback &&
-             ((struct IdempotentCallback *)cb->ctx)->ctx == ctx)) {
-            sfree(cb);
-        } else {
-            if (!newhead)
-                newhead = cb;
-            else
-                newtail->next = cb;
-
-            newtail = cb;
+    struct callback **old = cbhash;
+    size_t oldsize = cbhash_size;
+
+    cbhash_size = oldsize ? oldsize * 2 : 64;
+    cbhash = snewn(cbhash_size, struct callback *);
+    memset(cbhash, 0, cbhash_size * sizeof(*cbhash));
+
+    for (size_t i = 0; i < oldsize; i++) {
+        struct callback *cb, *next;
+        for (cb = old[i]; cb; cb = next) {
+            next = cb->hnext;
+            hash_add(cb);
         }
     }
+    sfree(old);
+}
+
+/*
+ * Take a node off both the run queue and its hash chain.
+ */
+static void unqueue(struct callback *cb)
+{
+    if (cb->prev)
+        cb->prev->next = cb->next;
+    else
+        cbhead = cb->next;
+    if (cb->next)
+        cb->next->prev = cb->prev;
+    else
+        cbtail = cb->prev;
 
-    cbhead = newhead;
-    cbtail = newtail;
-    if (newtail)
-        newtail->next = NULL;
+    hash_remove(cb);
+    nqueued--;
 }
 
-void queue_toplevel_callback(toplevel_callback_fn_t fn, void *ctx)
+static void free_callback(struct callback *cb)
+{
+    cb->next = cbfree;
+    cbfree = cb;
+}
+
+static void run_idempotent_callback(void *ctx)
+{
+    struct IdempotentCallback *ic = (struct IdempotentCallback *)ctx;
+    ic->queued = false;
+    ic->fn(ic->ctx);
+}
+
+static void queue_callback(toplevel_callback_fn_t fn, void *ctx,
+                           void *owner)
 {
     struct callback *cb;
 
-    cb = snew(struct callback);
+    if (cbfree) {
+        cb = cbfree;
+        cbfree = cb->next;
+    } else {
+        cb = snew(struct callback);
+    }
     cb->fn = fn;
     cb->ctx = ctx;
+    cb->owner = owner;
 
     /*
      * If the front end has requested notification of pending
@@ -91,12 +151,47 @@ void queue_toplevel_callback(toplevel_callback_fn_t fn, void *ctx)
     if (notify_frontend && !cbhead && !cbcurr)
         notify_frontend(notify_ctx);
 
+    cb->next = NULL;
+    cb->prev = cbtail;
     if (cbtail)
         cbtail->next = cb;
     else
         cbhead = cb;
     cbtail = cb;
-    cb->next = NULL;
+
+    if (nqueued >= cbhash_size)
+        hash_grow();
+    hash_add(cb);
+    nqueued++;
+}
+
+void queue_idempotent_callback(struct IdempotentCallback *ic)
+{
+    if (ic->queued)
+        return;
+    ic->queued = true;
+    queue_callback(run_idempotent_callback, ic, ic->ctx);
+}
+
+void queue_toplevel_callback(toplevel_callback_fn_t fn, void *ctx)
+{
+    queue_callback(fn, ctx, ctx);
+}
+
+void delete_callbacks_for_context(void *ctx)
+{
+    struct callback *cb, *next;
+
+    if (!nqueued)
+        return;
+
+    for (cb = cbhash[owner_hash(ctx)]; cb; cb = next) {
+        next = cb->hnext;
+        if (cb->owner == ctx) {
+            unqueue(cb);
+            free_callback(cb);
+        }
+    }
 }
 
 bool run_toplevel_callbacks(void)
@@ -111,15 +206,13 @@ bool run_toplevel_callbacks(void)
          * it's not there.
          */
         cbcurr = cbhead;
-        cbhead = cbhead->next;
-        if (!cbhead)
-            cbtail = NULL;
+        unqueue(cbcurr);
 
         /*
          * Now run the callback, and then clear it out of cbcurr.
          */
         cbcurr->fn(cbcurr->ctx);
-        sfree(cbcurr);
+        free_callback(cbcurr);
         cbcurr = NULL;
 
         done_something = true;
@@ -131,3 +224,207 @@ bool toplevel_callback_pending(void)
 {
     return cbcurr != NULL || cbhead != NULL;
 }
+
+bool toplevel_callbacks_waiting(void)
+{
+    return cbhead != NULL;
+}
+
+#ifdef TEST
+
+/*
+ * Test code for the callback queue. A random sequence of
+ * queue_toplevel_callback, queue_idempotent_callback,
+ * delete_callbacks_for_context and run_toplevel_callbacks is checked
+ * against a simple model: the callbacks must run in the order they
+ * were queued, minus whatever was deleted, and the front end must be
+ * notified exactly when the queue stops being empty. Some of the
+ * callbacks queue or delete more callbacks themselves.
+ *
+ *   cc -DTEST -I. -Iunix -Icharset -o testcallback callback.c memory.c \
+ *      utils.c marshal.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void out_of_memory(void) { fprintf(stderr, "out of memory\n"); exit(1); }
+
+static unsigned long test_rng_state = 1;
+static unsigned long test_rng(void)
+{
+    test_rng_state = (test_rng_state * 1103515245 + 12345) & 0xFFFFFFFF;
+    return (test_rng_state >> 16) & 0x7FFF;
+}
+
+#define NCTX 32
+#define MAXQ 100000
+
+struct testctx {
+    IdempotentCallback ic;
+};
+static struct testctx ctxs[NCTX];
+
+struct entry {
+    int ctx;
+    bool idem;
+};
+static struct entry model[MAXQ];
+static int modelhead, modeltail;
+
+static int fails, notifications;
+static struct entry ran;
+static bool did_run;
+
+static void model_add(int ctx, bool idem)
+{
+    if (modeltail == MAXQ) {
+        memmove(model, model + modelhead,
+                (modeltail - modelhead) * sizeof(*model));
+        modeltail -= modelhead;
+        modelhead = 0;
+        if (modeltail == MAXQ) {
+            printf("model queue overflowed\n");
+            exit(1);
+        }
+    }
+    model[modeltail].ctx = ctx;
+    model[modeltail].idem = idem;
+    modeltail++;
+}
+
+static void model_delete(int ctx)
+{
+    int j = modelhead;
+    for (int i = modelhead; i < modeltail; i++)
+        if (model[i].ctx != ctx)
+            model[j++] = model[i];
+    modeltail = j;
+}
+
+static void plain_cb(void *vctx);
+
+static void queue_plain(int ctx)
+{
+    model_add(ctx, false);
+    queue_toplevel_callback(plain_cb, &ctxs[ctx]);
+}
+
+static void queue_idem(int ctx)
+{
+    if (ctxs[ctx].ic.queued)
+        return;
+    model_add(ctx, true);
+    queue_idempotent_callback(&ctxs[ctx].ic);
+}
+
+static void delete_ctx(int ctx)
+{
+    delete_callbacks_for_context(&ctxs[ctx]);
+    model_delete(ctx);
+    /* callback.c leaves an idempotent callback marked as queued when
+     * it's deleted, so its owner must reset it, as real owners do by
+     * freeing the whole structure */
+    ctxs[ctx].ic.queued = false;
+}
+
+static void random_action(bool from_callback)
+{
+    unsigned long r = test_rng() % 100;
+    int ctx = test_rng() % NCTX;
+
+    if (r < 45)
+        queue_plain(ctx);
+    else if (r < 70)
+        queue_idem(ctx);
+    else if (r < 80 || from_callback)
+        delete_ctx(ctx);
+}
+
+static void record_run(int ctx, bool idem)
+{
+    ran.ctx = ctx;
+    ran.idem = idem;
+    did_run = true;
+
+    /* Sometimes rearrange the queue from inside a callback */
+    if (test_rng() % 4 == 0)
+        random_action(true);
+}
+
+static void plain_cb(void *vctx)
+{
+    record_run((struct testctx *)vctx - ctxs, false);
+}
+
+static void idem_cb(void *vctx)
+{
+    record_run((struct testctx *)vctx - ctxs, true);
+}
+
+static void notify(void *ctx)
+{
+    notifications++;
+}
+
+static void random_test(unsigned long steps)
+{
+    for (int i = 0; i < NCTX; i++) {
+        ctxs[i].ic.fn = idem_cb;
+        ctxs[i].ic.ctx = &ctxs[i];
+        ctxs[i].ic.queued = false;
+    }
+    request_callback_notifications(notify, NULL);
+
+    for (unsigned long step = 0; step < steps || modelhead < modeltail;
+         step++) {
+        if (step < steps && test_rng() % 100 < 50) {
+            int before = notifications;
+            bool was_empty = !toplevel_callback_pending();
+            random_action(false);
+            if (notifications != before + (was_empty &&
+                                            toplevel_callback_pending())) {
+                printf("step %lu: wrong number of notifications\n", step);
+                fails++;
+            }
+            continue;
+        }
+
+        if (toplevel_callback_pending() != (modelhead < modeltail)) {
+            printf("step %lu: pending = %d, but model has %d\n", step,
+                   (int)toplevel_callback_pending(), modeltail - modelhead);
+            fails++;
+            break;
+        }
+        if (modelhead == modeltail)
+            continue;
+
+        /* Take the expected entry off the model before running, since
+         * the callback may change the queue */
+        struct entry expect = model[modelhead++];
+        did_run = false;
+        run_toplevel_callbacks();
+        if (!did_run || ran.ctx != expect.ctx || ran.idem != expect.idem) {
+            printf("step %lu: ran ctx %d (%s), expected ctx %d (%s)\n",
+                   step, ran.ctx, ran.idem ? "idempotent" : "plain",
+                   expect.ctx, expect.idem ? "idempotent" : "plain");
+            fails++;
+            break;
+        }
+    }
+
+    if (toplevel_callback_pending()) {
+        printf("callbacks still pending at the end\n");
+        fails++;
+    }
+    request_callback_notifications(NULL, NULL);
+}
+
+int main(void)
+{
+    random_test(500000);
+    printf("%s\n", fails ? "tests failed" : "all tests passed");
+    return fails != 0 ? 1 : 0;
+}
+
+#endif
@@ -64,8 +64,10 @@ typedef struct Filename Filename;
 typedef struct FontSpec FontSpec;
 
 typedef struct bufchain_tag bufchain;
+typedef struct bufslice bufslice;
 
 typedef struct strbuf strbuf;
+typedef struct memarena memarena;
 typedef struct LoadedFile LoadedFile;
 
 typedef struct RSAKey RSAKey;
@@ -131,6 +133,7 @@ typedef struct ssh_hashalg ssh_hashalg;
 typedef struct ssh_hash ssh_hash;
 typedef struct ssh_kex ssh_kex;
 typedef struct ssh_kexes ssh_kexes;
+typedef struct kex_precomp_cache kex_precomp_cache;
 typedef struct ssh_keyalg ssh_keyalg;
 typedef struct ssh_key ssh_key;
 typedef struct ssh_compressor ssh_compressor;
@@ -190,6 +193,13 @@ typedef struct PacketProtocolLayer PacketProtocolLayer;
 #define NORETURN
 #endif
 
+/* Storage class for a variable with a separate copy in each thread */
+#if defined _MSC_VER && !defined __clang__
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 /* ----------------------------------------------------------------------
  * Platform-specific definitions.
  *
@@ -10,7 +10,230 @@
 #include "puttymem.h"
 #include "misc.h"
 
-void *safemalloc(size_t factor1, size_t factor2, size_t addend)
+#ifdef MEMPROFILE
+/* The functions those macros stand in for are defined in here */
+#undef safemalloc
+#undef saferealloc
+#undef safegrowarray
+
+#include <stdatomic.h>
+#endif
+
+static inline void *raw_malloc(size_t size)
+{
+#ifdef MINEFIELD
+    return minefield_c_malloc(size);
+#else
+    return malloc(size);
+#endif
+}
+
+static inline void *raw_realloc(void *ptr, size_t size)
+{
+#ifdef MINEFIELD
+    return minefield_c_realloc(ptr, size);
+#else
+    return realloc(ptr, size);
+#endif
+}
+
+static inline void raw_free(void *ptr)
+{
+#ifdef MINEFIELD
+    minefield_c_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+#ifdef MEMPROFILE
+
+/*
+ * Each block starts with a header saying which site allocated it and
+ * how big it is, so that freeing it can be charged back to the right
+ * place. Sites live in a fixed-size hash table, which is only ever
+ * added to. Any thread may allocate, so the counters are atomic, and
+ * adding a site to the table takes a spinlock.
+ */
+
+#define MEMPROF_NSITES 8192             /* must be a power of 2 */
+#define MEMPROF_MAGIC 0x4D50524FU
+
+struct memprof_site {
+    _Atomic(const char *) file;
+    int line;
+    atomic_ullong nallocs, nfrees, bytes;
+    atomic_size_t live, peak;
+};
+
+typedef union memprof_header {
+    struct {
+        struct memprof_site *site;
+        size_t size;
+        unsigned magic;
+    } h;
+    max_align_t align;
+} memprof_header;
+
+static struct memprof_site memprof_sites[MEMPROF_NSITES];
+static struct memprof_site memprof_other;   /* when the table is full */
+static struct memprof_site memprof_total;
+static atomic_flag memprof_lock = ATOMIC_FLAG_INIT;
+static atomic_ullong memprof_foreign;   /* frees of blocks not ours */
+
+static struct memprof_site *memprof_find_site(const char *file, int line)
+{
+    /*
+     * Hash the file name rather than the pointer, because the same
+     * __FILE__ in two translation units needn't be the same string.
+     */
+    unsigned long hash = line;
+    for (const char *p = file; *p; p++)
+        hash = hash * 31 + (unsigned char)*p;
+
+    for (size_t i = 0; i < MEMPROF_NSITES; i++) {
+        struct memprof_site *site =
+            &memprof_sites[(hash + i) & (MEMPROF_NSITES - 1)];
+        const char *sfile =
+            atomic_load_explicit(&site->file, memory_order_acquire);
+
+        if (!sfile) {
+            while (atomic_flag_test_and_set_explicit(
+                       &memprof_lock, memory_order_acquire));
+            sfile = atomic_load_explicit(&site->file, memory_order_relaxed);
+            if (!sfile) {
+                site->line = line;
+                atomic_store_explicit(&site->file, file,
+                                      memory_order_release);
+                sfile = file;
+            }
+            atomic_flag_clear_explicit(&memprof_lock, memory_order_release);
+        }
+
+        if (site->line == line && (sfile == file || !strcmp(sfile, file)))
+            return site;
+    }
+
+    return &memprof_other;
+}
+
+static void memprof_peak(atomic_size_t *peak, size_t live)
+{
+    size_t old = atomic_load_explicit(peak, memory_order_relaxed);
+    while (live > old && !atomic_compare_exchange_weak_explicit(
+               peak, &old, live,
+               memory_order_relaxed, memory_order_relaxed));
+}
+
+/*
+ * Charge 'add' bytes to a site and take 'sub' away, counting 'allocs'
+ * allocations and 'frees' frees. A resize is both at once.
+ */
+static void memprof_account_one(struct memprof_site *site, size_t add,
+                                size_t sub, int allocs, int frees)
+{
+    atomic_fetch_add_explicit(&site->nallocs, allocs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->nfrees, frees, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->bytes, add, memory_order_relaxed);
+    if (add >= sub) {
+        size_t live = add - sub + atomic_fetch_add_explicit(
+            &site->live, add - sub, memory_order_relaxed);
+        memprof_peak(&site->peak, live);
+    } else {
+        atomic_fetch_sub_explicit(&site->live, sub - add,
+                                  memory_order_relaxed);
+    }
+}
+
+static void memprof_account(struct memprof_site *site, size_t add,
+                            size_t sub, int allocs, int frees)
+{
+    memprof_account_one(site, add, sub, allocs, frees);
+    memprof_account_one(&memprof_total, add, sub, allocs, frees);
+}
+
+static void *memprof_attach(memprof_header *hdr, size_t size,
+                            struct memprof_site *site)
+{
+    hdr->h.site = site;
+    hdr->h.size = size;
+    hdr->h.magic = MEMPROF_MAGIC;
+    return hdr + 1;
+}
+
+/*
+ * Find the header of a block we allocated.
+ *
+ * This reads the header-sized area in front of 'ptr' without knowing
+ * it belongs to us, so it relies on every pointer given to sfree or
+ * srealloc in a MEMPROFILE build having come from safemalloc. Memory
+ * from the C library or the platform (strdup, realpath, toolkit
+ * strings) must be released with free() instead, which is also what
+ * a MINEFIELD build needs. The magic check is only a last line of
+ * defence against a mistake in that, returning NULL so the block is
+ * counted as foreign; it can't make such a call well defined.
+ */
+static memprof_header *memprof_header_of(void *ptr)
+{
+    memprof_header *hdr = (memprof_header *)ptr - 1;
+    return hdr->h.magic == MEMPROF_MAGIC ? hdr : NULL;
+}
+
+static void *memprof_alloc(size_t size, const char *file, int line)
+{
+    memprof_header *hdr;
+
+    if (size > SIZE_MAX - sizeof(memprof_header))
+        return NULL;
+    hdr = raw_malloc(sizeof(memprof_header) + size);
+    if (!hdr)
+        return NULL;
+    struct memprof_site *site = memprof_find_site(file, line);
+    memprof_account(site, size, 0, 1, 0);
+    return memprof_attach(hdr, size, site);
+}
+
+/* A resized block stays charged to the site that first allocated it */
+static void *memprof_resize(void *ptr, size_t size)
+{
+    memprof_header *hdr = memprof_header_of(ptr);
+    struct memprof_site *site;
+    size_t oldsize;
+
+    if (!hdr)
+        return raw_realloc(ptr, size);
+
+    if (size > SIZE_MAX - sizeof(memprof_header))
+        return NULL;
+    site = hdr->h.site;
+    oldsize = hdr->h.size;
+    hdr = raw_realloc(hdr, sizeof(memprof_header) + size);
+    if (!hdr)
+        return NULL;
+    memprof_account(site, size, oldsize, 0, 0);
+    return memprof_attach(hdr, size, site);
+}
+
+static void memprof_release(void *ptr)
+{
+    memprof_header *hdr = memprof_header_of(ptr);
+
+    if (!hdr) {
+        atomic_fetch_add_explicit(&memprof_foreign, 1, memory_order_relaxed);
+        raw_free(ptr);
+        return;
+    }
+
+    memprof_account(hdr->h.site, 0, hdr->h.size, 0, 1);
+    hdr->h.magic = 0;
+    raw_free(hdr);
+}
+
+#endif /* MEMPROFILE */
+
+static inline void *safemalloc_inner(
+    size_t factor1, size_t factor2, size_t addend,
+    const char *file, int line)
 {
     if (factor1 > SIZE_MAX / factor2)
         goto fail;
@@ -26,10 +249,10 @@ void *safemalloc(size_t factor1, size_t factor2, size_t addend)
         size = 1;
 
     void *p;
-#ifdef MINEFIELD
-    p = minefield_c_malloc(size);
+#ifdef MEMPROFILE
+    p = memprof_alloc(size, file, line);
 #else
-    p = malloc(size);
+    p = raw_malloc(size);
 #endif
 
     if (!p)
@@ -41,7 +264,8 @@ void *safemalloc(size_t factor1, size_t factor2, size_t addend)
     out_of_memory();
 }
 
-void *saferealloc(void *ptr, size_t n, size_t size)
+static inline void *saferealloc_inner(
+    void *ptr, size_t n, size_t size, const char *file, int line)
 {
     void *p;
 
@@ -49,19 +273,17 @@ void *saferealloc(void *ptr, size_t n, size_t size)
         p = NULL;
     } else {
         size *= n;
-        if (!ptr) {
-#ifdef MINEFIELD
-            p = minefield_c_malloc(size);
+#ifdef MEMPROFILE
+        if (!ptr)
+            p = memprof_alloc(size, file, line);
+        else
+            p = memprof_resize(ptr, size);
 #else
-            p = malloc(size);
+        if (!ptr)
+            p = raw_malloc(size);
+        else
+            p = raw_realloc(ptr, size);
 #endif
-        } else {
-#ifdef MINEFIELD
-            p = minefield_c_realloc(ptr, size);
-#else
-            p = realloc(ptr, size);
-#endif
-        }
     }
 
     if (!p)
@@ -73,16 +295,17 @@ void *saferealloc(void *ptr, size_t n, size_t size)
 void safefree(void *ptr)
 {
     if (ptr) {
-#ifdef MINEFIELD
-        minefield_c_free(ptr);
+#ifdef MEMPROFILE
+        memprof_release(ptr);
 #else
-        free(ptr);
+        raw_free(ptr);
 #endif
     }
 }
 
-void *safegrowarray(void *ptr, size_t *allocated, size_t eltsize,
-                    size_t oldlen, size_t extralen, bool secret)
+static inline void *safegrowarray_inner(
+    void *ptr, size_t *allocated, size_t eltsize, size_t oldlen,
+    size_t extralen, bool secret, const char *file, int line)
 {
     /* The largest value we can safely multiply by eltsize */
     assert(eltsize > 0);
@@ -120,15 +343,165 @@ void *safegrowarray(void *ptr, size_t *allocated, size_t eltsize,
     size_t newsize = oldsize + increment;
     void *toret;
     if (secret) {
-        toret = safemalloc(newsize, eltsize, 0);
+#ifdef MEMPROFILE
+        /* Keep charging the array to wherever it started out */
+        memprof_header *hdr = ptr ? memprof_header_of(ptr) : NULL;
+        if (hdr) {
+            file = atomic_load(&hdr->h.site->file);
+            line = hdr->h.site->line;
+        }
+#endif
+        toret = safemalloc_inner(newsize, eltsize, 0, file, line);
         if (oldsize) {
             memcpy(toret, ptr, oldsize * eltsize);
             smemclr(ptr, oldsize * eltsize);
             sfree(ptr);
         }
     } else {
-        toret = saferealloc(ptr, newsize, eltsize);
+        toret = saferealloc_inner(ptr, newsize, eltsize, file, line);
     }
     *allocated = newsize;
     return toret;
 }
+
+void *safemalloc(size_t factor1, size_t factor2, size_t addend)
+{
+    return safemalloc_inner(factor1, factor2, addend, "(unknown)", 0);
+}
+
+void *saferealloc(void *ptr, size_t n, size_t size)
+{
+    return saferealloc_inner(ptr, n, size, "(unknown)", 0);
+}
+
+void *safegrowarray(void *ptr, size_t *allocated, size_t eltsize,
+                    size_t oldlen, size_t extralen, bool secret)
+{
+    return safegrowarray_inner(ptr, allocated, eltsize, oldlen, extralen,
+                               secret, "(unknown)", 0);
+}
+
+#ifdef MEMPROFILE
+
+void *memprof_malloc(size_t factor1, size_t factor2, size_t addend,
+                     const char *file, int line)
+{
+    return safemalloc_inner(factor1, factor2, addend, file, line);
+}
+
+void *memprof_realloc(void *ptr, size_t n, size_t size,
+                      const char *file, int line)
+{
+    return saferealloc_inner(ptr, n, size, file, line);
+}
+
+void *memprof_growarray(void *ptr, size_t *allocated, size_t eltsize,
+                        size_t oldlen, size_t extralen, bool secret,
+                        const char *file, int line)
+{
+    return safegrowarray_inner(ptr, allocated, eltsize, oldlen, extralen,
+                               secret, file, line);
+}
+
+/* A snapshot of one site's counters, for sorting */
+struct memprof_row {
+    const char *file;
+    int line;
+    unsigned long long nallocs, nfrees, bytes;
+    size_t live, peak;
+};
+
+static void memprof_snapshot(struct memprof_row *row,
+                             struct memprof_site *site, const char *file)
+{
+    row->file = file;
+    row->line = site->line;
+    row->nallocs = atomic_load(&site->nallocs);
+    row->nfrees = atomic_load(&site->nfrees);
+    row->bytes = atomic_load(&site->bytes);
+    row->live = atomic_load(&site->live);
+    row->peak = atomic_load(&site->peak);
+}
+
+static int memprof_row_cmp(const void *av, const void *bv)
+{
+    const struct memprof_row *a = av, *b = bv;
+    if (a->live != b->live)
+        return a->live > b->live ? -1 : +1;
+    if (a->bytes != b->bytes)
+        return a->bytes > b->bytes ? -1 : +1;
+    return 0;
+}
+
+static void memprof_output_row(
+    void (*output)(void *ctx, const char *line), void *ctx,
+    const struct memprof_row *row)
+{
+    char buf[256], where[128];
+
+    if (row->line)
+        snprintf(where, sizeof(where), "%s:%d", row->file, row->line);
+    else
+        snprintf(where, sizeof(where), "%s", row->file);
+    snprintf(buf, sizeof(buf), "%-32s %10llu %10llu %12llu %12zu %12zu",
+             where, row->nallocs, row->nfrees, row->bytes,
+             row->live, row->peak);
+    output(ctx, buf);
+}
+
+void memprof_report(void (*output)(void *ctx, const char *line), void *ctx,
+                    int maxsites)
+{
+    struct memprof_row *rows, total;
+    size_t nrows = 0;
+    char buf[128];
+
+    /*
+     * Use the underlying allocator for the table, so that making the
+     * report doesn't show up in it.
+     */
+    rows = raw_malloc((MEMPROF_NSITES + 1) * sizeof(*rows));
+    if (!rows)
+        return;
+
+    for (size_t i = 0; i < MEMPROF_NSITES; i++) {
+        const char *file = atomic_load(&memprof_sites[i].file);
+        if (file)
+            memprof_snapshot(&rows[nrows++], &memprof_sites[i], file);
+    }
+    if (atomic_load(&memprof_other.nallocs))
+        memprof_snapshot(&rows[nrows++], &memprof_other, "(other sites)");
+    memprof_snapshot(&total, &memprof_total, "total");
+
+    qsort(rows, nrows, sizeof(*rows), memprof_row_cmp);
+    if (maxsites > 0 && nrows > (size_t)maxsites)
+        nrows = maxsites;
+
+    output(ctx, "Memory allocation profile:");
+    snprintf(buf, sizeof(buf), "%-32s %10s %10s %12s %12s %12s",
+             "site", "allocs", "frees", "bytes", "live", "peak");
+    output(ctx, buf);
+    for (size_t i = 0; i < nrows; i++)
+        memprof_output_row(output, ctx, &rows[i]);
+    memprof_output_row(output, ctx, &total);
+    if (atomic_load(&memprof_foreign)) {
+        snprintf(buf, sizeof(buf), "%llu frees of blocks from elsewhere",
+                 (unsigned long long)atomic_load(&memprof_foreign));
+        output(ctx, buf);
+    }
+
+    raw_free(rows);
+}
+
+static void memprof_output_file(void *ctx, const char *line)
+{
+    fprintf((FILE *)ctx, "%s\n", line);
+}
+
+void memprof_report_file(FILE *fp, int maxsites)
+{
+    memprof_report(memprof_output_file, fp, maxsites);
+    fflush(fp);
+}
+
+#endif /* MEMPROFILE */
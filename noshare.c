@@ -23,3 +23,9 @@ int platform_ssh_share(const char *name, Conf *conf,
 void platform_ssh_share_cleanup(const char *name)
 {
 }
+
+int platform_ssh_share_detach(const char *name, char **logtext)
+{
+    *logtext = dupstr("connection sharing not supported");
+    return SHARE_DETACH_FAILED;
+}
@@ -0,0 +1,32 @@
+/*
+ * Stub version of the worker-thread functions, for platforms without
+ * a real implementation. Jobs run straight away on the calling
+ * thread, but their 'done' callbacks are still deferred to the
+ * toplevel callback queue, so the caller sees the same order of
+ * events either way.
+ */
+
+#include "putty.h"
+
+void worker_submit(toplevel_callback_fn_t run, toplevel_callback_fn_t done,
+                   void *ctx)
+{
+    run(ctx);
+    queue_toplevel_callback(done, ctx);
+}
+
+void worker_cancel_for_context(void *ctx)
+{
+    delete_callbacks_for_context(ctx);
+}
+
+void cross_thread_callbacks_init(void)
+{
+}
+
+void queue_toplevel_callback_from_thread(toplevel_callback_fn_t fn,
+                                         void *ctx)
+{
+    /* There are no other threads to call this */
+    queue_toplevel_callback(fn, ctx);
+}
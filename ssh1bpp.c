@@ -111,7 +111,7 @@ void ssh1_bpp_start_compression(BinaryPacketProtocol *bpp)
     assert(!s->compctx);
     assert(!s->decompctx);
 
-    s->compctx = ssh_compressor_new(&ssh_zlib);
+    s->compctx = ssh_compressor_new(&ssh_zlib, ZLIB_DEFAULT_LEVEL);
     s->decompctx = ssh_decompressor_new(&ssh_zlib);
 
     bpp_logevent("Started zlib (RFC1950) compression");
@@ -332,7 +332,7 @@ static void ssh1_bpp_format_packet(struct ssh1_bpp_state *s, PktOut *pkt)
     pktoffs = 8 - pad;
     biglen = len + pad;         /* len(padding+type+data+CRC) */
 
-    random_read(pkt->data + pktoffs, 4+8 - pktoffs);
+    random_read_fast(pkt->data + pktoffs, 4+8 - pktoffs);
     crc = crc32_ssh1(
         make_ptrlen(pkt->data + pktoffs + 4, biglen - 4)); /* all ex len */
     PUT_32BIT_MSB_FIRST(pkt->data + pktoffs + 4 + biglen - 4, crc);
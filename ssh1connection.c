@@ -146,7 +146,7 @@ PacketProtocolLayer *ssh1_connection_new(
 
     s->conf = conf_copy(conf);
 
-    s->channels = newtree234(ssh1_channelcmp);
+    s->channels = newbtree234(ssh1_channelcmp, true);
 
     s->x11authtree = newtree234(x11_authcmp);
 
@@ -15,6 +15,56 @@ struct ssh2_bpp_direction {
     ssh2_mac *mac;
     bool etm_mode;
     const ssh_compression_alg *pending_compression;
+    int compression_level;
+};
+
+/*
+ * With the crypto thread enabled, outgoing packets at least this long
+ * are encrypted by a worker thread. Shorter ones aren't worth the
+ * trip, unless they have to queue behind a long one.
+ *
+ * Incoming packets have a higher threshold, because we can't decrypt
+ * ahead: the next packet might be NEWKEYS, so input stops until each
+ * one comes back, and the round trip (tens of microseconds) has to be
+ * small next to the cost of the crypto.
+ */
+#define CRYPTO_THREAD_MIN_OUT_PACKET 4096
+#define CRYPTO_THREAD_MIN_IN_PACKET 16384
+
+/*
+ * Outgoing packets at least this long aren't copied into out_raw.
+ * Shorter ones are cheaper to copy than to keep track of.
+ */
+#define SLICE_MIN_PACKET 1024
+
+/*
+ * An outgoing packet on its way to the cipher. Its random padding is
+ * read from the PRNG on the main thread, when the packet is queued,
+ * because the PRNG is not thread-safe. We read as much as the
+ * cipher's block size could need (4 + blksize - 1), leaving room for
+ * block sizes of up to 32 bytes.
+ */
+#define MAX_RANDOM_PADDING (4 + 32 - 1)
+typedef struct ssh2_outpkt ssh2_outpkt;
+struct ssh2_outpkt {
+    PktOut *pkt;
+    unsigned long sequence;
+    unsigned char random[MAX_RANDOM_PADDING];
+    long rawlen;                       /* packet length before the MAC */
+    ssh2_outpkt *next;
+};
+
+/* A run of outgoing packets handed to a worker thread in one go */
+struct ssh2_out_batch {
+    struct ssh2_bpp_state *s;
+    ssh2_outpkt *head;
+    bool finished;                     /* written by the worker */
+};
+
+/* The incoming packet being decrypted by a worker thread, if any */
+struct ssh2_in_job {
+    bool busy;
+    bool finished, mac_ok;             /* written by the worker */
 };
 
 struct ssh2_bpp_state {
@@ -41,6 +91,18 @@ struct ssh2_bpp_state {
     unsigned nnewkeys;
     int prev_type;
 
+    /*
+     * The crypto thread. While out_batch is in the hands of a worker,
+     * further outgoing packets wait in out_pending. While in_job is
+     * busy, handle_input waits for it. Either way, the worker owns
+     * that direction's cipher, MAC and compressor until it's done.
+     */
+    bool crypto_thread;
+    struct ssh2_out_batch *out_batch;
+    ssh2_outpkt *out_pending_head, *out_pending_tail;
+    struct ssh2_in_job in_job;
+    bool in_crypt_pending;
+
     BinaryPacketProtocol bpp;
 };
 
@@ -48,6 +110,9 @@ static void ssh2_bpp_free(BinaryPacketProtocol *bpp);
 static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp);
 static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp);
 static PktOut *ssh2_bpp_new_pktout(int type);
+static void ssh2_bpp_sync_crypto(struct ssh2_bpp_state *s);
+static void ssh2_bpp_cancel_crypto(struct ssh2_bpp_state *s);
+static void ssh2_bpp_out_batch_done(void *ctx);
 
 static const BinaryPacketProtocolVtable ssh2_bpp_vtable = {
     .free = ssh2_bpp_free,
@@ -104,6 +169,7 @@ static void ssh2_bpp_free_incoming_crypto(struct ssh2_bpp_state *s)
 static void ssh2_bpp_free(BinaryPacketProtocol *bpp)
 {
     struct ssh2_bpp_state *s = container_of(bpp, struct ssh2_bpp_state, bpp);
+    ssh2_bpp_cancel_crypto(s);
     sfree(s->buf);
     ssh2_bpp_free_outgoing_crypto(s);
     ssh2_bpp_free_incoming_crypto(s);
@@ -115,12 +181,14 @@ void ssh2_bpp_new_outgoing_crypto(
     BinaryPacketProtocol *bpp,
     const ssh_cipheralg *cipher, const void *ckey, const void *iv,
     const ssh2_macalg *mac, bool etm_mode, const void *mac_key,
-    const ssh_compression_alg *compression, bool delayed_compression)
+    const ssh_compression_alg *compression, bool delayed_compression,
+    int compression_level)
 {
     struct ssh2_bpp_state *s;
     assert(bpp->vt == &ssh2_bpp_vtable);
     s = container_of(bpp, struct ssh2_bpp_state, bpp);
 
+    ssh2_bpp_sync_crypto(s);
     ssh2_bpp_free_outgoing_crypto(s);
 
     if (cipher) {
@@ -155,6 +223,7 @@ void ssh2_bpp_new_outgoing_crypto(
 
     if (delayed_compression && !s->seen_userauth_success) {
         s->out.pending_compression = compression;
+        s->out.compression_level = compression_level;
         s->out_comp = NULL;
 
         bpp_logevent("Will enable %s compression after user authentication",
@@ -165,7 +234,7 @@ void ssh2_bpp_new_outgoing_crypto(
         /* 'compression' is always non-NULL, because no compression is
          * indicated by ssh_comp_none. But this setup call may return a
          * null out_comp. */
-        s->out_comp = ssh_compressor_new(compression);
+        s->out_comp = ssh_compressor_new(compression, compression_level);
 
         if (s->out_comp)
             bpp_logevent("Initialised %s compression",
@@ -183,6 +252,7 @@ void ssh2_bpp_new_incoming_crypto(
     assert(bpp->vt == &ssh2_bpp_vtable);
     s = container_of(bpp, struct ssh2_bpp_state, bpp);
 
+    ssh2_bpp_sync_crypto(s);
     ssh2_bpp_free_incoming_crypto(s);
 
     if (cipher) {
@@ -251,6 +321,9 @@ static void ssh2_bpp_enable_pending_compression(struct ssh2_bpp_state *s)
 {
     BinaryPacketProtocol *bpp = &s->bpp; /* for bpp_logevent */
 
+    /* Packets already queued must go out uncompressed */
+    ssh2_bpp_sync_crypto(s);
+
     if (s->in.pending_compression) {
         s->in_decomp = ssh_decompressor_new(s->in.pending_compression);
         bpp_logevent("Initialised delayed %s decompression",
@@ -258,7 +331,8 @@ static void ssh2_bpp_enable_pending_compression(struct ssh2_bpp_state *s)
         s->in.pending_compression = NULL;
     }
     if (s->out.pending_compression) {
-        s->out_comp = ssh_compressor_new(s->out.pending_compression);
+        s->out_comp = ssh_compressor_new(s->out.pending_compression,
+                                         s->out.compression_level);
         bpp_logevent("Initialised delayed %s compression",
                      ssh_compressor_alg(s->out_comp)->text_name);
         s->out.pending_compression = NULL;
@@ -278,6 +352,54 @@ static void ssh2_bpp_enable_pending_compression(struct ssh2_bpp_state *s)
 
 #define userauth_range(pkttype) ((unsigned)((pkttype) - 50) < 20)
 
+/*
+ * The expensive part of receiving a packet, once all of it is in
+ * s->data: checking the MAC and decrypting whatever hasn't been
+ * decrypted already. In ETM mode we check the MAC first; otherwise
+ * the first cipher block was decrypted to find the length, and we
+ * decrypt the rest before checking the MAC. Returns false if the MAC
+ * is wrong.
+ *
+ * This may run on a worker thread.
+ */
+static bool ssh2_bpp_in_crypt(struct ssh2_bpp_state *s)
+{
+    if (s->in.mac && s->in.etm_mode) {
+        if (!ssh2_mac_verify(s->in.mac, s->data, s->len + 4,
+                             s->in.sequence))
+            return false;
+
+        /* Decrypt everything between the length field and the MAC. */
+        if (s->in.cipher)
+            ssh_cipher_decrypt(s->in.cipher, s->data + 4, s->packetlen - 4);
+        return true;
+    } else {
+        /* Decrypt everything _except_ the MAC. */
+        if (s->in.cipher)
+            ssh_cipher_decrypt(s->in.cipher, s->data + s->cipherblk,
+                               s->packetlen - s->cipherblk);
+
+        return !s->in.mac || ssh2_mac_verify(s->in.mac, s->data, s->len + 4,
+                                             s->in.sequence);
+    }
+}
+
+static void ssh2_bpp_in_job_run(void *ctx)
+{
+    struct ssh2_bpp_state *s = container_of(
+        ctx, struct ssh2_bpp_state, in_job);
+    s->in_job.mac_ok = ssh2_bpp_in_crypt(s);
+    s->in_job.finished = true;
+}
+
+static void ssh2_bpp_in_job_done(void *ctx)
+{
+    struct ssh2_bpp_state *s = container_of(
+        ctx, struct ssh2_bpp_state, in_job);
+    s->in_job.busy = false;
+    queue_idempotent_callback(&s->bpp.ic_in_raw);
+}
+
 static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
 {
     struct ssh2_bpp_state *s = container_of(bpp, struct ssh2_bpp_state, bpp);
@@ -420,23 +542,11 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             memcpy(s->data, s->buf, 4);
 
             /*
-             * Read the remainder of the packet.
+             * Read the remainder of the packet. Checking the MAC and
+             * decrypting it are done below.
              */
             BPP_READ(s->data + 4, s->packetlen + s->maclen - 4);
-
-            /*
-             * Check the MAC.
-             */
-            if (s->in.mac && !ssh2_mac_verify(
-                    s->in.mac, s->data, s->len + 4, s->in.sequence)) {
-                ssh_sw_abort(s->bpp.ssh, "Incorrect MAC received on packet");
-                crStopV;
-            }
-
-            /* Decrypt everything between the length field and the MAC. */
-            if (s->in.cipher)
-                ssh_cipher_decrypt(
-                    s->in.cipher, s->data + 4, s->packetlen - 4);
+            s->in_crypt_pending = true;
         } else {
             if (s->bufsize < s->cipherblk) {
                 s->bufsize = s->cipherblk;
@@ -485,22 +595,31 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             memcpy(s->data, s->buf, s->cipherblk);
 
             /*
-             * Read and decrypt the remainder of the packet.
+             * Read the remainder of the packet. Decrypting it and
+             * checking the MAC are done below.
              */
             BPP_READ(s->data + s->cipherblk,
                      s->packetlen + s->maclen - s->cipherblk);
+            s->in_crypt_pending = true;
+        }
 
-            /* Decrypt everything _except_ the MAC. */
-            if (s->in.cipher)
-                ssh_cipher_decrypt(
-                    s->in.cipher,
-                    s->data + s->cipherblk, s->packetlen - s->cipherblk);
-
-            /*
-             * Check the MAC.
-             */
-            if (s->in.mac && !ssh2_mac_verify(
-                    s->in.mac, s->data, s->len + 4, s->in.sequence)) {
+        if (s->in_crypt_pending) {
+            s->in_crypt_pending = false;
+            if (s->crypto_thread &&
+                s->packetlen >= CRYPTO_THREAD_MIN_IN_PACKET) {
+                /*
+                 * Hand the packet to a worker thread, and go back to
+                 * the event loop until it's done.
+                 */
+                s->in_job.busy = true;
+                s->in_job.finished = false;
+                worker_submit(ssh2_bpp_in_job_run, ssh2_bpp_in_job_done,
+                              &s->in_job);
+                crWaitUntilV(!s->in_job.busy);
+            } else {
+                s->in_job.mac_ok = ssh2_bpp_in_crypt(s);
+            }
+            if (!s->in_job.mac_ok) {
                 ssh_sw_abort(s->bpp.ssh, "Incorrect MAC received on packet");
                 crStopV;
             }
@@ -733,22 +852,16 @@ static PktOut *ssh2_bpp_new_pktout(int pkt_type)
     return pkt;
 }
 
-static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
+/*
+ * Compress, pad, MAC and encrypt an outgoing packet in place, using
+ * the sequence number and padding chosen for it when it was queued.
+ *
+ * This may run on a worker thread.
+ */
+static void ssh2_bpp_encrypt_packet(struct ssh2_bpp_state *s, ssh2_outpkt *op)
 {
-    int origlen, cipherblk, maclen, padding, unencrypted_prefix, i;
-
-    if (s->bpp.logctx) {
-        ptrlen pktdata = make_ptrlen(pkt->data + pkt->prefix,
-                                     pkt->length - pkt->prefix);
-        logblank_t blanks[MAX_BLANKS];
-        int nblanks = ssh2_censor_packet(
-            s->bpp.pls, pkt->type, true, pktdata, blanks);
-        log_packet(s->bpp.logctx, PKT_OUTGOING, pkt->type,
-                   ssh2_pkt_type(s->bpp.pls->kctx, s->bpp.pls->actx,
-                                 pkt->type),
-                   pktdata.ptr, pktdata.len, nblanks, blanks, &s->out.sequence,
-                   pkt->downstream_id, pkt->additional_log_text);
-    }
+    PktOut *pkt = op->pkt;
+    int origlen, cipherblk, maclen, padding, unencrypted_prefix;
 
     cipherblk = s->out.cipher ? ssh_cipher_alg(s->out.cipher)->blksize : 8;
     cipherblk = cipherblk < 8 ? 8 : cipherblk;  /* or 8 if blksize < 8 */
@@ -789,12 +902,10 @@ static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
     padding +=
         (cipherblk - (pkt->length - unencrypted_prefix + padding) % cipherblk)
         % cipherblk;
-    assert(padding <= 255);
+    assert(padding <= MAX_RANDOM_PADDING);
     maclen = s->out.mac ? ssh2_mac_alg(s->out.mac)->len : 0;
     origlen = pkt->length;
-    for (i = 0; i < padding; i++)
-        put_byte(pkt, 0);              /* make space for random padding */
-    random_read(pkt->data + origlen, padding);
+    put_data(pkt, op->random, padding);
     pkt->data[4] = padding;
     PUT_32BIT_MSB_FIRST(pkt->data, origlen + padding - 4);
 
@@ -802,7 +913,7 @@ static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
     if (s->out.cipher &&
         (ssh_cipher_alg(s->out.cipher)->flags & SSH_CIPHER_SEPARATE_LENGTH)) {
         ssh_cipher_encrypt_length(s->out.cipher, pkt->data, 4,
-                                  s->out.sequence);
+                                  op->sequence);
     }
 
     put_padding(pkt, maclen, 0);
@@ -815,21 +926,220 @@ static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
             ssh_cipher_encrypt(s->out.cipher,
                                pkt->data + 4, origlen + padding - 4);
         ssh2_mac_generate(s->out.mac, pkt->data, origlen + padding,
-                          s->out.sequence);
+                          op->sequence);
     } else {
         /*
          * SSH-2 standard protocol.
          */
         if (s->out.mac)
             ssh2_mac_generate(s->out.mac, pkt->data, origlen + padding,
-                              s->out.sequence);
+                              op->sequence);
         if (s->out.cipher)
             ssh_cipher_encrypt(s->out.cipher, pkt->data, origlen + padding);
     }
 
-    s->out.sequence++;       /* whether or not we MACed */
+    op->rawlen = origlen + padding;
+}
+
+static void ssh2_bpp_release_pktout(void *ctx)
+{
+    ssh_free_pktout((PktOut *)ctx);
+}
+
+/*
+ * Put an encrypted packet on the wire, and free it. A big packet's
+ * buffer goes into out_raw as it is, and is freed once it's sent.
+ */
+static void ssh2_bpp_output_packet(struct ssh2_bpp_state *s, ssh2_outpkt *op)
+{
+    PktOut *pkt = op->pkt;
+
+    dts_consume(&s->stats->out, op->rawlen);
+    if (pkt->length >= SLICE_MIN_PACKET) {
+        bufslice *sl = bufslice_new(pkt->data, pkt->length,
+                                    ssh2_bpp_release_pktout, pkt);
+        bufchain_add_slice(s->bpp.out_raw, sl, 0, pkt->length);
+        bufslice_unref(sl);
+    } else {
+        bufchain_add(s->bpp.out_raw, pkt->data, pkt->length);
+        ssh_free_pktout(pkt);
+    }
+}
+
+static void ssh2_bpp_out_batch_run(void *ctx)
+{
+    struct ssh2_out_batch *batch = (struct ssh2_out_batch *)ctx;
+
+    for (ssh2_outpkt *op = batch->head; op; op = op->next)
+        ssh2_bpp_encrypt_packet(batch->s, op);
+    batch->finished = true;
+}
+
+static void ssh2_bpp_out_batch_finish(struct ssh2_out_batch *batch)
+{
+    struct ssh2_bpp_state *s = batch->s;
+    ssh2_outpkt *op;
+
+    while ((op = batch->head) != NULL) {
+        batch->head = op->next;
+        ssh2_bpp_output_packet(s, op);
+        sfree(op);
+    }
+    s->out_batch = NULL;
+    sfree(batch);
+}
+
+static void ssh2_bpp_out_batch_start(struct ssh2_bpp_state *s)
+{
+    struct ssh2_out_batch *batch = snew(struct ssh2_out_batch);
+
+    batch->s = s;
+    batch->head = s->out_pending_head;
+    batch->finished = false;
+    s->out_pending_head = s->out_pending_tail = NULL;
+    s->out_batch = batch;
+    worker_submit(ssh2_bpp_out_batch_run, ssh2_bpp_out_batch_done, batch);
+}
+
+static void ssh2_bpp_out_batch_done(void *ctx)
+{
+    struct ssh2_out_batch *batch = (struct ssh2_out_batch *)ctx;
+    struct ssh2_bpp_state *s = batch->s;
+
+    ssh2_bpp_out_batch_finish(batch);
+
+    /* Everything queued while that batch was out goes next */
+    if (s->out_pending_head)
+        ssh2_bpp_out_batch_start(s);
+}
+
+/*
+ * Get back everything the worker threads are working on, finishing
+ * off on this thread whatever they haven't done, so that the crypto
+ * and compression state are ours again. This is needed before
+ * anything changes that state, or forks.
+ */
+static void ssh2_bpp_sync_crypto(struct ssh2_bpp_state *s)
+{
+    ssh2_outpkt *op;
+
+    if (s->out_batch) {
+        struct ssh2_out_batch *batch = s->out_batch;
+        worker_cancel_for_context(batch);
+        if (!batch->finished)
+            ssh2_bpp_out_batch_run(batch);
+        ssh2_bpp_out_batch_finish(batch);
+    }
+
+    while ((op = s->out_pending_head) != NULL) {
+        s->out_pending_head = op->next;
+        ssh2_bpp_encrypt_packet(s, op);
+        ssh2_bpp_output_packet(s, op);
+        sfree(op);
+    }
+    s->out_pending_tail = NULL;
+
+    if (s->in_job.busy) {
+        worker_cancel_for_context(&s->in_job);
+        if (!s->in_job.finished)
+            ssh2_bpp_in_job_run(&s->in_job);
+        ssh2_bpp_in_job_done(&s->in_job);
+    }
+}
+
+/*
+ * When the BPP is being freed, just stop the worker threads using it.
+ */
+static void ssh2_bpp_cancel_crypto(struct ssh2_bpp_state *s)
+{
+    ssh2_outpkt *op, *next;
+
+    if (s->out_batch) {
+        worker_cancel_for_context(s->out_batch);
+        for (op = s->out_batch->head; op; op = next) {
+            next = op->next;
+            ssh_free_pktout(op->pkt);
+            sfree(op);
+        }
+        sfree(s->out_batch);
+        s->out_batch = NULL;
+    }
+    for (op = s->out_pending_head; op; op = next) {
+        next = op->next;
+        ssh_free_pktout(op->pkt);
+        sfree(op);
+    }
+    s->out_pending_head = s->out_pending_tail = NULL;
 
-    dts_consume(&s->stats->out, origlen + padding);
+    if (s->in_job.busy)
+        worker_cancel_for_context(&s->in_job);
+}
+
+void ssh2_bpp_enable_crypto_thread(BinaryPacketProtocol *bpp)
+{
+    struct ssh2_bpp_state *s;
+    assert(bpp->vt == &ssh2_bpp_vtable);
+    s = container_of(bpp, struct ssh2_bpp_state, bpp);
+
+    s->crypto_thread = true;
+}
+
+void ssh2_bpp_finish_crypto_thread(BinaryPacketProtocol *bpp)
+{
+    if (bpp->vt == &ssh2_bpp_vtable)
+        ssh2_bpp_sync_crypto(container_of(bpp, struct ssh2_bpp_state, bpp));
+}
+
+/*
+ * Log an outgoing packet, give it its sequence number and padding,
+ * and then either encrypt it and send it straight away, or queue it
+ * for the crypto thread. Either way, the packet is ours to free.
+ */
+static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
+{
+    ssh2_outpkt *op, op_local;
+    int cipherblk;
+
+    if (s->bpp.logctx) {
+        ptrlen pktdata = make_ptrlen(pkt->data + pkt->prefix,
+                                     pkt->length - pkt->prefix);
+        logblank_t blanks[MAX_BLANKS];
+        int nblanks = ssh2_censor_packet(
+            s->bpp.pls, pkt->type, true, pktdata, blanks);
+        log_packet(s->bpp.logctx, PKT_OUTGOING, pkt->type,
+                   ssh2_pkt_type(s->bpp.pls->kctx, s->bpp.pls->actx,
+                                 pkt->type),
+                   pktdata.ptr, pktdata.len, nblanks, blanks, &s->out.sequence,
+                   pkt->downstream_id, pkt->additional_log_text);
+    }
+
+    bool queue = s->crypto_thread &&
+        (s->out_batch || pkt->length >= CRYPTO_THREAD_MIN_OUT_PACKET);
+    op = queue ? snew(ssh2_outpkt) : &op_local;
+
+    cipherblk = s->out.cipher ? ssh_cipher_alg(s->out.cipher)->blksize : 8;
+    cipherblk = cipherblk < 8 ? 8 : cipherblk;
+    assert(4 + cipherblk - 1 <= MAX_RANDOM_PADDING);
+
+    op->pkt = pkt;
+    op->sequence = s->out.sequence++;  /* whether or not we MAC */
+    random_read_fast(op->random, 4 + cipherblk - 1);
+
+    if (!queue) {
+        ssh2_bpp_encrypt_packet(s, op);
+        ssh2_bpp_output_packet(s, op);
+        return;
+    }
+
+    op->next = NULL;
+    if (s->out_pending_tail)
+        s->out_pending_tail->next = op;
+    else
+        s->out_pending_head = op;
+    s->out_pending_tail = op;
+
+    if (!s->out_batch)
+        ssh2_bpp_out_batch_start(s);
 }
 
 static void ssh2_bpp_format_packet(struct ssh2_bpp_state *s, PktOut *pkt)
@@ -890,15 +1200,12 @@ static void ssh2_bpp_format_packet(struct ssh2_bpp_state *s, PktOut *pkt)
             size_t origlen = ignore_pkt->length;
             for (size_t i = 0; i < length; i++)
                 put_byte(ignore_pkt, 0);  /* make space for random padding */
-            random_read(ignore_pkt->data + origlen, length);
+            random_read_fast(ignore_pkt->data + origlen, length);
             ssh2_bpp_format_packet_inner(s, ignore_pkt);
-            bufchain_add(s->bpp.out_raw, ignore_pkt->data, ignore_pkt->length);
-            ssh_free_pktout(ignore_pkt);
         }
     }
 
     ssh2_bpp_format_packet_inner(s, pkt);
-    bufchain_add(s->bpp.out_raw, pkt->data, pkt->length);
 }
 
 static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
@@ -939,9 +1246,10 @@ static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
          * SSH_MSG_IGNORE if the last cipher block of the previous
          * packet has already been sent to the network (which we
          * approximate conservatively by checking if it's vanished
-         * from out_raw).
+         * from out_raw; if the crypto thread still has packets, it
+         * hasn't even been encrypted yet).
          */
-        if (bufchain_size(s->bpp.out_raw) <
+        if (!s->out_batch && bufchain_size(s->bpp.out_raw) <
             (ssh_cipher_alg(s->out.cipher)->blksize +
              ssh2_mac_alg(s->out.mac)->len)) {
             /*
@@ -963,7 +1271,6 @@ static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
             n_userauth--;
 
         ssh2_bpp_format_packet(s, pkt);
-        ssh_free_pktout(pkt);
 
         if (n_userauth == 0 && s->out.pending_compression && !s->is_server) {
             /*
@@ -157,6 +157,11 @@ static const SshChannelVtable ssh2channel_vtable = {
 static void ssh2_channel_check_close(struct ssh2_channel *c);
 static void ssh2_channel_try_eof(struct ssh2_channel *c);
 static void ssh2_set_window(struct ssh2_channel *c, int newwin);
+static void ssh2_flush_window_adjusts(struct ssh2_connection_state *s);
+static void ssh2_winadj_timer(void *ctx, unsigned long now);
+static void ssh2_channel_autotune(struct ssh2_channel *c, size_t arrived,
+                                  size_t bufsize);
+static int ssh2_max_window(Conf *conf);
 static size_t ssh2_try_send(struct ssh2_channel *c);
 static void ssh2_try_send_and_unthrottle(struct ssh2_channel *c);
 static void ssh2_channel_check_throttle(struct ssh2_channel *c);
@@ -165,6 +170,7 @@ static void ssh2_channel_close_local(struct ssh2_channel *c,
 static void ssh2_channel_destroy(struct ssh2_channel *c);
 
 static void ssh2_check_termination(struct ssh2_connection_state *s);
+static void ssh2_share_idle_timer(void *ctx, unsigned long now);
 
 struct outstanding_global_request {
     gr_handler_fn_t handler;
@@ -219,6 +225,8 @@ struct outstanding_channel_request {
 
 static void ssh2_channel_free(struct ssh2_channel *c)
 {
+    if (c->pending_winadj)
+        c->connlayer->n_pending_winadj--;
     bufchain_clear(&c->outbuffer);
     bufchain_clear(&c->errbuffer);
     while (c->chanreq_head) {
@@ -257,10 +265,12 @@ PacketProtocolLayer *ssh2_connection_new(
      */
     s->persistent = conf_get_bool(s->conf, CONF_ssh_no_shell);
 
+    s->max_window = ssh2_max_window(s->conf);
+
     s->connshare = connshare;
     s->peer_verstring = dupstr(peer_verstring);
 
-    s->channels = newtree234(ssh2_channelcmp);
+    s->channels = newbtree234(ssh2_channelcmp, true);
 
     s->x11authtree = newtree234(x11_authcmp);
 
@@ -287,6 +297,8 @@ static void ssh2_connection_free(PacketProtocolLayer *ppl)
     struct ssh2_channel *c;
     struct ssh_rportfwd *rpf;
 
+    expire_timer_context(s);
+
     sfree(s->peer_verstring);
 
     conf_free(s->conf);
@@ -534,6 +546,7 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                 data = get_string(pktin);
                 if (!get_err(pktin)) {
                     int bufsize;
+                    bool overfull;
                     c->locwindow -= data.len;
                     c->remlocwin -= data.len;
                     if (ext_type != 0 && ext_type != SSH2_EXTENDED_DATA_STDERR)
@@ -553,15 +566,21 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                     if (c->sharectx)
                         break;
 
+                    ssh2_channel_autotune(c, data.len, bufsize);
+
                     /*
                      * If it looks like the remote end hit the end of
                      * its window, and we didn't want it to do that,
-                     * think about using a larger window.
+                     * think about using a larger window. (This is
+                     * all we can do until autotuning has an RTT
+                     * estimate to work with, which it never will if
+                     * the server can't cope with winadj requests.)
                      */
                     if (c->remlocwin <= 0 &&
                         c->throttle_state == UNTHROTTLED &&
-                        c->locmaxwin < 0x40000000)
-                        c->locmaxwin += OUR_V2_WINSIZE;
+                        c->locmaxwin < s->max_window)
+                        c->locmaxwin = min(c->locmaxwin + OUR_V2_WINSIZE,
+                                           s->max_window);
 
                     /*
                      * If we are not buffering too much data, enlarge
@@ -577,11 +596,22 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                      * if we're buffering anything at all and we're in
                      * "simple" mode, throttle the whole channel.
                      */
-                    if ((bufsize > c->locmaxwin ||
-                         (s->ssh_is_simple && bufsize>0)) &&
-                        !c->throttling_conn) {
+                    overfull = (bufsize > c->locmaxwin ||
+                                (s->ssh_is_simple && bufsize>0));
+                    if (overfull && !c->throttling_conn) {
                         c->throttling_conn = true;
                         ssh_throttle_conn(s->ppl.ssh, +1);
+                    } else if (!overfull && c->throttling_conn) {
+                        /*
+                         * Conversely, if we were throttling but
+                         * packets that were already decoded before
+                         * the throttle took effect have found the
+                         * backlog gone, lift the throttle here: the
+                         * channel has nothing left to flush, so it
+                         * may never call our unthrottle method.
+                         */
+                        c->throttling_conn = false;
+                        ssh_throttle_conn(s->ppl.ssh, -1);
                     }
                 }
                 break;
@@ -854,10 +884,17 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
     }
 }
 
+#define WINADJ_BATCH_DELAY (TICKSPERSEC / 50)
+
+struct winadj {
+    unsigned size;
+    unsigned long sent;                /* GETTICKCOUNT() when we sent it */
+};
+
 static void ssh2_handle_winadj_response(struct ssh2_channel *c,
                                         PktIn *pktin, void *ctx)
 {
-    unsigned *sizep = ctx;
+    struct winadj *wa = ctx;
 
     /*
      * Winadj responses should always be failures. However, at least
@@ -867,8 +904,27 @@ static void ssh2_handle_winadj_response(struct ssh2_channel *c,
      * life, we don't worry about what kind of response we got.
      */
 
-    c->remlocwin += *sizep;
-    sfree(sizep);
+    c->remlocwin += wa->size;
+
+    /*
+     * The server answers this as soon as it sees it, so the time it
+     * took is a round-trip time measurement for autotuning. Smooth
+     * it the same way TCP does (RFC 6298), and never let it be zero,
+     * which means 'no estimate'.
+     */
+    if (pktin) {
+        unsigned long rtt = GETTICKCOUNT() - wa->sent;
+        if (!c->srtt) {
+            c->srtt = rtt;
+            c->rate_start = GETTICKCOUNT();
+            c->rate_bytes = 0;
+        } else {
+            c->srtt = (7 * c->srtt + rtt) / 8;
+        }
+        if (!c->srtt)
+            c->srtt = 1;
+    }
+    sfree(wa);
     /*
      * winadj messages are only sent when the window is fully open, so
      * if we get an ack of one, we know any pending unthrottle is
@@ -914,42 +970,184 @@ static void ssh2_set_window(struct ssh2_channel *c, int newwin)
      * sending a WINDOW_ADJUST for every character in a shell session.
      *
      * "Significant" is arbitrarily defined as half the window size.
+     *
+     * Even then, we don't send it straight away, so that adjusts for
+     * lots of busy channels can be gathered up and sent together
+     * (and so that one channel gets one bigger adjust rather than
+     * several small ones). We wait until either WINADJ_BATCH_DELAY
+     * has passed, or the other end has used up all but a quarter of
+     * the window we're about to give it, at which point we mustn't
+     * hang about in case it runs out.
      */
     if (newwin / 2 >= c->locwindow) {
-        PktOut *pktout;
-        unsigned *up;
+        if (!c->pending_winadj)
+            s->n_pending_winadj++;
+        c->pending_winadj = newwin;
+
+        if (c->locwindow <= newwin / 4) {
+            ssh2_flush_window_adjusts(s);
+        } else if (!s->winadj_timer_set) {
+            s->winadj_timer_set = true;
+            s->winadj_timer = schedule_timer(
+                WINADJ_BATCH_DELAY, ssh2_winadj_timer, s);
+        }
+    } else if (c->pending_winadj) {
+        /* We've changed our minds about how big the window should
+         * be, and the change is no longer worth sending. */
+        c->pending_winadj = 0;
+        s->n_pending_winadj--;
+    }
+}
 
-        /*
-         * In order to keep track of how much window the client
-         * actually has available, we'd like it to acknowledge each
-         * WINDOW_ADJUST.  We can't do that directly, so we accompany
-         * it with a CHANNEL_REQUEST that has to be acknowledged.
-         *
-         * This is only necessary if we're opening the window wide.
-         * If we're not, then throughput is being constrained by
-         * something other than the maximum window size anyway.
-         */
-        if (newwin == c->locmaxwin &&
-            !(s->ppl.remote_bugs & BUG_CHOKES_ON_WINADJ)) {
-            up = snew(unsigned);
-            *up = newwin - c->locwindow;
-            pktout = ssh2_chanreq_init(c, "winadj@putty.projects.tartarus.org",
-                                       ssh2_handle_winadj_response, up);
-            pq_push(s->ppl.out_pq, pktout);
+static void ssh2_send_window_adjust(struct ssh2_channel *c)
+{
+    struct ssh2_connection_state *s = c->connlayer;
+    int newwin = c->pending_winadj;
+    PktOut *pktout;
+    struct winadj *wa;
 
-            if (c->throttle_state != UNTHROTTLED)
-                c->throttle_state = UNTHROTTLING;
-        } else {
-            /* Pretend the WINDOW_ADJUST was acked immediately. */
-            c->remlocwin = newwin;
-            c->throttle_state = THROTTLED;
-        }
-        pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_CHANNEL_WINDOW_ADJUST);
-        put_uint32(pktout, c->remoteid);
-        put_uint32(pktout, newwin - c->locwindow);
+    c->pending_winadj = 0;
+    s->n_pending_winadj--;
+
+    /* Things may have changed since we decided to send this. */
+    if (c->closes & (CLOSES_RCVD_EOF | CLOSES_SENT_CLOSE))
+        return;
+    if (newwin <= c->locwindow)
+        return;
+
+    /*
+     * In order to keep track of how much window the client
+     * actually has available, we'd like it to acknowledge each
+     * WINDOW_ADJUST.  We can't do that directly, so we accompany
+     * it with a CHANNEL_REQUEST that has to be acknowledged.
+     *
+     * This is only necessary if we're opening the window wide.
+     * If we're not, then throughput is being constrained by
+     * something other than the maximum window size anyway.
+     */
+    if (newwin == c->locmaxwin &&
+        !(s->ppl.remote_bugs & BUG_CHOKES_ON_WINADJ)) {
+        wa = snew(struct winadj);
+        wa->size = newwin - c->locwindow;
+        wa->sent = GETTICKCOUNT();
+        pktout = ssh2_chanreq_init(c, "winadj@putty.projects.tartarus.org",
+                                   ssh2_handle_winadj_response, wa);
         pq_push(s->ppl.out_pq, pktout);
-        c->locwindow = newwin;
+
+        if (c->throttle_state != UNTHROTTLED)
+            c->throttle_state = UNTHROTTLING;
+    } else {
+        /* Pretend the WINDOW_ADJUST was acked immediately. */
+        c->remlocwin = newwin;
+        c->throttle_state = THROTTLED;
+    }
+    pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_CHANNEL_WINDOW_ADJUST);
+    put_uint32(pktout, c->remoteid);
+    put_uint32(pktout, newwin - c->locwindow);
+    pq_push(s->ppl.out_pq, pktout);
+    c->locwindow = newwin;
+}
+
+/*
+ * Send every WINDOW_ADJUST we've been saving up.
+ */
+static void ssh2_flush_window_adjusts(struct ssh2_connection_state *s)
+{
+    struct ssh2_channel *c;
+    int i;
+
+    for (i = 0; s->n_pending_winadj > 0 &&
+             (c = index234(s->channels, i)) != NULL; i++)
+        if (c->pending_winadj)
+            ssh2_send_window_adjust(c);
+}
+
+static void ssh2_winadj_timer(void *ctx, unsigned long now)
+{
+    struct ssh2_connection_state *s = (struct ssh2_connection_state *)ctx;
+
+    if (!s->winadj_timer_set || now != s->winadj_timer)
+        return;
+
+    s->winadj_timer_set = false;
+    ssh2_flush_window_adjusts(s);
+}
+
+/*
+ * Receive-window autotuning, in the style of TCP's receive buffer
+ * autotuning. Called whenever we learn how much data the local side
+ * of the channel is buffering: 'arrived' is the amount of new data
+ * we've just handed it, and 'bufsize' its backlog afterwards.
+ *
+ * Once per round trip, we look at how much data the local side
+ * consumed in that time. If the window was what limited us, that
+ * will be about one window's worth, so asking for twice as much lets
+ * the window keep growing as long as the local side keeps up, until
+ * it covers the bandwidth-delay product (or hits the configured
+ * cap). If instead the local side has stopped reading, we shrink the
+ * window back towards what it's actually managing, so that a stalled
+ * channel doesn't tie up a huge window's worth of memory.
+ */
+#define AUTOTUNE_MIN_INTERVAL (TICKSPERSEC / 100)
+
+static void ssh2_channel_autotune(struct ssh2_channel *c, size_t arrived,
+                                  size_t bufsize)
+{
+    struct ssh2_connection_state *s = c->connlayer;
+    unsigned long now, interval;
+    size_t consumed, target;
+
+    /*
+     * Simple sessions have an effectively infinite window, and
+     * fixed-window channels mustn't have theirs changed.
+     */
+    if (s->ssh_is_simple || c->chan->initial_fixed_window_size)
+        return;
+
+    consumed = c->backlog + arrived;
+    consumed = (consumed > bufsize ? consumed - bufsize : 0);
+    c->backlog = bufsize;
+    c->rate_bytes += consumed;
+    if (bufsize > c->locmaxwin / 2)
+        c->stalled = true;
+
+    if (!c->srtt)
+        return;                        /* no RTT estimate yet */
+
+    now = GETTICKCOUNT();
+    interval = max(c->srtt, AUTOTUNE_MIN_INTERVAL);
+    if (now - c->rate_start < interval)
+        return;
+
+    target = 2 * c->rate_bytes;
+    if (target > s->max_window)
+        target = s->max_window;
+    if (target < OUR_V2_WINSIZE)
+        target = OUR_V2_WINSIZE;
+
+    if (target > c->locmaxwin && !c->stalled) {
+        c->locmaxwin = target;
+    } else if (target < c->locmaxwin && c->stalled) {
+        /* Shrink gradually, in case this was only a brief stall. */
+        c->locmaxwin = max(c->locmaxwin / 2, target);
     }
+
+    c->rate_start = now;
+    c->rate_bytes = 0;
+    c->stalled = false;
+}
+
+static int ssh2_max_window(Conf *conf)
+{
+    unsigned long max = parse_blocksize(
+        conf_get_str(conf, CONF_ssh_max_window));
+
+    /* 0 means no limit, i.e. as large as we ever let a window get */
+    if (max == 0 || max > 0x40000000)
+        max = 0x40000000;
+    if (max < OUR_V2_WINSIZE)
+        max = OUR_V2_WINSIZE;
+    return max;
 }
 
 static PktIn *ssh2_connection_pop(struct ssh2_connection_state *s)
@@ -1238,8 +1436,21 @@ static void ssh2_channel_destroy(struct ssh2_channel *c)
     queue_toplevel_callback(ssh2_check_termination_callback, s);
 }
 
+static bool ssh2_has_own_channels(struct ssh2_connection_state *s)
+{
+    struct ssh2_channel *c;
+    int i;
+
+    for (i = 0; (c = index234(s->channels, i)) != NULL; i++)
+        if (!c->sharectx)
+            return true;
+    return false;
+}
+
 static void ssh2_check_termination(struct ssh2_connection_state *s)
 {
+    int share_persist;
+
     /*
      * Decide whether we should terminate the SSH connection now.
      * Called after a channel or a downstream goes away. The general
@@ -1258,6 +1469,42 @@ static void ssh2_check_termination(struct ssh2_connection_state *s)
         return;
     }
 
+    share_persist = conf_get_int(s->conf, CONF_ssh_connection_sharing_persist);
+    if (s->connshare && share_can_persist && share_persist > 0 &&
+        !ssh2_has_own_channels(s)) {
+        /*
+         * We're a sharing upstream configured to outlive our own
+         * session. Once that session has finished, hand the
+         * connection over to a background process, so that whoever
+         * ran us can get on with things while downstreams carry on
+         * using it.
+         */
+        if (!s->share_detached) {
+            switch (ssh_share_detach(s->ppl.ssh)) {
+              case SHARE_DETACH_FOREGROUND:
+                return;            /* and s has been freed */
+              case SHARE_DETACH_BACKGROUND:
+                s->share_detached = true;
+                break;
+              case SHARE_DETACH_FAILED:
+                goto no_persist;
+            }
+        }
+
+        /*
+         * Then, whenever the connection falls idle, give it a fixed
+         * time for another downstream to turn up before closing it.
+         */
+        if (count234(s->channels) == 0 &&
+            share_ndownstreams(s->connshare) == 0) {
+            s->share_idle_timer_set = true;
+            s->share_idle_timer = schedule_timer(
+                share_persist * TICKSPERSEC, ssh2_share_idle_timer, s);
+        }
+        return;
+    }
+  no_persist:
+
     if (count234(s->channels) == 0 &&
         !(s->connshare && share_ndownstreams(s->connshare) > 0)) {
         /*
@@ -1274,6 +1521,20 @@ static void ssh2_check_termination(struct ssh2_connection_state *s)
     }
 }
 
+static void ssh2_share_idle_timer(void *ctx, unsigned long now)
+{
+    struct ssh2_connection_state *s = (struct ssh2_connection_state *)ctx;
+
+    if (!s->share_idle_timer_set || now != s->share_idle_timer)
+        return;
+    s->share_idle_timer_set = false;
+
+    if (count234(s->channels) == 0 && share_ndownstreams(s->connshare) == 0)
+        ssh_user_close(s->ppl.ssh, "Shared connection idle for %d seconds",
+                       conf_get_int(s->conf,
+                                    CONF_ssh_connection_sharing_persist));
+}
+
 /*
  * Set up most of a new ssh2_channel. Nulls out sharectx, but leaves
  * chan untouched (since it will sometimes have been filled in before
@@ -1291,6 +1552,10 @@ void ssh2_channel_init(struct ssh2_channel *c)
         s->ssh_is_simple ? OUR_V2_BIGWIN : OUR_V2_WINSIZE;
     c->chanreq_head = NULL;
     c->throttle_state = UNTHROTTLED;
+    c->srtt = c->rate_start = 0;
+    c->rate_bytes = c->backlog = 0;
+    c->stalled = false;
+    c->pending_winadj = 0;
     bufchain_init(&c->outbuffer);
     bufchain_init(&c->errbuffer);
     c->sc.vt = &ssh2channel_vtable;
@@ -1392,6 +1657,8 @@ static void ssh2channel_unthrottle(SshChannel *sc, size_t bufsize)
     struct ssh2_connection_state *s = c->connlayer;
     size_t buflimit;
 
+    ssh2_channel_autotune(c, 0, bufsize);
+
     buflimit = s->ssh_is_simple ? 0 : c->locmaxwin;
     if (bufsize < buflimit)
         ssh2_set_window(c, buflimit - bufsize);
@@ -1574,6 +1841,7 @@ static void ssh2_send_packet_from_downstream(
     PktOut *pkt = ssh_bpp_new_pktout(s->ppl.bpp, type);
     pkt->downstream_id = id;
     pkt->additional_log_text = additional_log_text;
+    ssh_pkt_reserve(pkt, datalen);
     put_data(pkt, data, datalen);
     pq_push(s->ppl.out_pq, pkt);
 }
@@ -1740,6 +2008,8 @@ static void ssh2_connection_reconfigure(PacketProtocolLayer *ppl, Conf *conf)
     conf_free(s->conf);
     s->conf = conf_copy(conf);
 
+    s->max_window = ssh2_max_window(s->conf);
+
     if (s->portfwdmgr_configured)
         portfwdmgr_config(s->portfwdmgr, s->conf);
 }
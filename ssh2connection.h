@@ -21,11 +21,25 @@ struct ssh2_connection_state {
     bool persistent;
     bool started;
 
+    /* Connection-sharing upstream outliving its own session: whether
+     * we've gone into the background yet, and the idle timer that
+     * will eventually close the connection. */
+    bool share_detached;
+    bool share_idle_timer_set;
+    unsigned long share_idle_timer;
+
     Conf *conf;
+    int max_window;                    /* cap on any channel's locmaxwin */
 
     tree234 *channels;                 /* indexed by local id */
     bool all_channels_throttled;
 
+    /* Channels with a WINDOW_ADJUST waiting to be sent, and the timer
+     * that will send them. */
+    size_t n_pending_winadj;
+    bool winadj_timer_set;
+    unsigned long winadj_timer;
+
     bool X11_fwd_enabled;
     tree234 *x11authtree;
 
@@ -119,6 +133,27 @@ struct ssh2_channel {
 
     enum { THROTTLED, UNTHROTTLING, UNTHROTTLED } throttle_state;
 
+    /*
+     * Receive-window autotuning. srtt is a smoothed estimate of the
+     * round-trip time (in ticks, or 0 if we don't have one yet),
+     * taken from how long winadj requests take to be answered.
+     * rate_bytes counts how much data the local side of the channel
+     * has consumed since rate_start; every round trip we use that to
+     * resize locmaxwin to cover the bandwidth-delay product. backlog
+     * is the amount the local side was last known to be buffering,
+     * and stalled records whether it held on to more than half the
+     * window at any point in the current sample.
+     */
+    unsigned long srtt, rate_start;
+    size_t rate_bytes, backlog;
+    bool stalled;
+
+    /*
+     * If nonzero, the window size we've decided to offer the other
+     * end but haven't yet sent a WINDOW_ADJUST for.
+     */
+    int pending_winadj;
+
     ssh_sharing_connstate *sharectx; /* sharing context, if this is a
                                       * downstream channel */
     Channel *chan;      /* handle the client side of this channel, if not */
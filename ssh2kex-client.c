@@ -19,6 +19,215 @@
  */
 const int deliberate_symbol_clash = 12345;
 
+/*
+ * Cache of ephemeral key pairs generated ahead of time. Making our
+ * half of a DH or ECDH exchange is the most expensive thing the
+ * client does during key exchange, and it doesn't depend on anything
+ * the server says (at least for fixed groups and curves). So we
+ * generate the key for the method we expect to use from a toplevel
+ * callback, while we're waiting for the network anyway: at
+ * connection setup while the TCP connection and version strings go
+ * back and forth, and when the transport layer sees a rekey coming.
+ *
+ * Each connection has its own cache, created and freed by ssh.c.
+ * Each key is handed out at most once, and freed (which wipes it) by
+ * whoever takes it.
+ */
+#define KEX_PRECOMP_SLOTS 2
+
+struct kex_precomp {
+    const ssh_kex *kex;                /* NULL if the slot is unused */
+    bool ready;
+    ecdh_key *ecdh_key;                /* for ECDH */
+    dh_ctx *dh_ctx;                    /* for DH, with e already made */
+    mp_int *e;
+};
+
+struct kex_precomp_cache {
+    struct kex_precomp slots[KEX_PRECOMP_SLOTS];
+    IdempotentCallback ic;
+};
+
+static void kex_precomp_callback(void *ctx);
+
+/*
+ * Upper limit on the exponent size we use for a fixed DH group. The
+ * real key exchange asks for twice the number of bits in the
+ * session's cipher keys, capped at the hash length; we don't know
+ * the cipher in advance, so we assume the cap, which is always
+ * enough.
+ */
+static int kex_precomp_dh_nbits(const ssh_kex *kex)
+{
+    return kex->hash->hlen * 8 * 2;
+}
+
+static bool kex_precomp_supported(const ssh_kex *kex)
+{
+    if (kex->main_type == KEXTYPE_ECDH)
+        return true;
+    if (kex->main_type == KEXTYPE_DH && !dh_is_gex(kex))
+        return true;
+    return false;                      /* GEX groups come from the server */
+}
+
+static void kex_precomp_clear(struct kex_precomp *pc)
+{
+    if (pc->ecdh_key)
+        ssh_ecdhkex_freekey(pc->ecdh_key);
+    if (pc->dh_ctx)
+        dh_cleanup(pc->dh_ctx);
+    memset(pc, 0, sizeof(*pc));
+}
+
+kex_precomp_cache *ssh2kex_precomp_new(void)
+{
+    kex_precomp_cache *kpc = snew(kex_precomp_cache);
+    memset(kpc, 0, sizeof(*kpc));
+    kpc->ic.fn = kex_precomp_callback;
+    kpc->ic.ctx = kpc;
+    return kpc;
+}
+
+void ssh2kex_precomp_free(kex_precomp_cache *kpc)
+{
+    delete_callbacks_for_context(kpc);
+    for (size_t i = 0; i < KEX_PRECOMP_SLOTS; i++)
+        kex_precomp_clear(&kpc->slots[i]);
+    sfree(kpc);
+}
+
+void ssh2kex_precompute(kex_precomp_cache *kpc, const ssh_kex *kex)
+{
+    struct kex_precomp *free_slot = NULL;
+
+    if (!kex_precomp_supported(kex))
+        return;
+
+    for (size_t i = 0; i < KEX_PRECOMP_SLOTS; i++) {
+        if (kpc->slots[i].kex == kex)
+            return;                    /* already have one, or will soon */
+        if (!kpc->slots[i].kex && !free_slot)
+            free_slot = &kpc->slots[i];
+    }
+    if (!free_slot)
+        return;
+
+    free_slot->kex = kex;
+    free_slot->ready = false;
+    queue_idempotent_callback(&kpc->ic);
+}
+
+/*
+ * At connection setup, guess the key exchange method from the
+ * user's preference list, on the assumption that most servers
+ * support whatever we like best.
+ */
+void ssh2kex_precompute_from_conf(kex_precomp_cache *kpc, Conf *conf)
+{
+    for (int i = 0; i < KEX_MAX; i++) {
+        switch (conf_get_int_int(conf, CONF_ssh_kexlist, i)) {
+          case KEX_ECDH:
+            ssh2kex_precompute(kpc, ssh_ecdh_kex.list[0]);
+            return;
+          case KEX_DHGROUP14:
+            ssh2kex_precompute(kpc, ssh_diffiehellman_group14.list[0]);
+            return;
+          case KEX_DHGROUP1:
+            ssh2kex_precompute(kpc, ssh_diffiehellman_group1.list[0]);
+            return;
+          case KEX_DHGEX:
+          case KEX_RSA:
+          case KEX_WARN:
+            /* Nothing we can usefully do in advance. */
+            return;
+        }
+    }
+}
+
+static void kex_precomp_callback(void *ctx)
+{
+    kex_precomp_cache *kpc = (kex_precomp_cache *)ctx;
+
+    /*
+     * Do one key per callback, so as not to hold up the event loop
+     * for longer than we have to.
+     */
+    for (size_t i = 0; i < KEX_PRECOMP_SLOTS; i++) {
+        struct kex_precomp *pc = &kpc->slots[i];
+        if (!pc->kex || pc->ready)
+            continue;
+
+        if (pc->kex->main_type == KEXTYPE_ECDH) {
+            pc->ecdh_key = ssh_ecdhkex_newkey(pc->kex);
+        } else {
+            pc->dh_ctx = dh_setup_group(pc->kex);
+            pc->e = dh_create_e(pc->dh_ctx, kex_precomp_dh_nbits(pc->kex));
+        }
+
+        if (!pc->ecdh_key && !pc->dh_ctx) {
+            memset(pc, 0, sizeof(*pc));
+            continue;
+        }
+        pc->ready = true;
+        queue_idempotent_callback(&kpc->ic);
+        return;
+    }
+}
+
+static struct kex_precomp *kex_precomp_find(kex_precomp_cache *kpc,
+                                            const ssh_kex *kex)
+{
+    if (!kpc)
+        return NULL;
+    for (size_t i = 0; i < KEX_PRECOMP_SLOTS; i++)
+        if (kpc->slots[i].kex == kex && kpc->slots[i].ready)
+            return &kpc->slots[i];
+    return NULL;
+}
+
+static ecdh_key *kex_precomp_take_ecdh(kex_precomp_cache *kpc,
+                                       const ssh_kex *kex)
+{
+    struct kex_precomp *pc = kex_precomp_find(kpc, kex);
+    if (!pc)
+        return NULL;
+    ecdh_key *key = pc->ecdh_key;
+    memset(pc, 0, sizeof(*pc));
+    return key;
+}
+
+static dh_ctx *kex_precomp_take_dh(kex_precomp_cache *kpc,
+                                   const ssh_kex *kex, int nbits, mp_int **e)
+{
+    struct kex_precomp *pc = kex_precomp_find(kpc, kex);
+    if (!pc || (nbits && nbits > kex_precomp_dh_nbits(kex)))
+        return NULL;
+    dh_ctx *ctx = pc->dh_ctx;
+    *e = pc->e;
+    memset(pc, 0, sizeof(*pc));
+    return ctx;
+}
+
+void ssh2_transport_provide_kex_precomp(PacketProtocolLayer *ppl,
+                                       kex_precomp_cache *kpc)
+{
+    struct ssh2_transport_state *s =
+        container_of(ppl, struct ssh2_transport_state, ppl);
+
+    s->kex_precomp = kpc;
+}
+
+void ssh2kex_precompute_next(struct ssh2_transport_state *s)
+{
+    if (!s->kex_precomp || s->next_kex_precomputed || s->kex_in_progress ||
+        (s->ppl.remote_bugs & BUG_SSH2_REKEY))
+        return;
+
+    ssh2kex_precompute(s->kex_precomp, s->kex_alg);
+    s->next_kex_precomputed = true;
+}
+
 void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
 {
     PacketProtocolLayer *ppl = &s->ppl; /* for ppl_logevent */
@@ -28,6 +237,8 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
     crBegin(s->crStateKex);
 
     if (s->kex_alg->main_type == KEXTYPE_DH) {
+        s->e = NULL;                   /* belonged to the last dh_ctx */
+
         /*
          * Work out the number of bits of key we will need from the
          * key exchange. We start with the maximum key length of
@@ -103,7 +314,12 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                          ssh_hash_alg(s->exhash)->text_name);
         } else {
             s->ppl.bpp->pls->kctx = SSH2_PKTCTX_DHGROUP;
-            s->dh_ctx = dh_setup_group(s->kex_alg);
+            s->dh_ctx = kex_precomp_take_dh(s->kex_precomp, s->kex_alg,
+                                            s->nbits * 2, &s->e);
+            if (s->dh_ctx)
+                ppl_logevent("Using precomputed Diffie-Hellman key");
+            else
+                s->dh_ctx = dh_setup_group(s->kex_alg);
             s->kex_init_value = SSH2_MSG_KEXDH_INIT;
             s->kex_reply_value = SSH2_MSG_KEXDH_REPLY;
 
@@ -115,10 +331,12 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
         }
 
         /*
-         * Now generate and send e for Diffie-Hellman.
+         * Now generate and send e for Diffie-Hellman, unless we
+         * already had one.
          */
         seat_set_busy_status(s->ppl.seat, BUSY_CPU);
-        s->e = dh_create_e(s->dh_ctx, s->nbits * 2);
+        if (!s->e)
+            s->e = dh_create_e(s->dh_ctx, s->nbits * 2);
         pktout = ssh_bpp_new_pktout(s->ppl.bpp, s->kex_init_value);
         put_mp_ssh2(pktout, s->e);
         pq_push(s->ppl.out_pq, pktout);
@@ -189,7 +407,11 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                      ssh_hash_alg(s->exhash)->text_name);
         s->ppl.bpp->pls->kctx = SSH2_PKTCTX_ECDHKEX;
 
-        s->ecdh_key = ssh_ecdhkex_newkey(s->kex_alg);
+        s->ecdh_key = kex_precomp_take_ecdh(s->kex_precomp, s->kex_alg);
+        if (s->ecdh_key)
+            ppl_logevent("Using precomputed ECDH key");
+        else
+            s->ecdh_key = ssh_ecdhkex_newkey(s->kex_alg);
         if (!s->ecdh_key) {
             ssh_sw_abort(s->ppl.ssh, "Unable to generate key for ECDH");
             *aborted = true;
@@ -198,9 +420,11 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
 
         pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_INIT);
         {
-            strbuf *pubpoint = strbuf_new();
+            memarena *ma = memarena_new();
+            strbuf *pubpoint = strbuf_new_in(ma);
             ssh_ecdhkex_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
             put_stringsb(pktout, pubpoint);
+            memarena_free(ma);
         }
 
         pq_push(s->ppl.out_pq, pktout);
@@ -221,10 +445,11 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
         s->hkey = ssh_key_new_pub(s->hostkey_alg, s->hostkeydata);
 
         {
-            strbuf *pubpoint = strbuf_new();
+            memarena *ma = memarena_new();
+            strbuf *pubpoint = strbuf_new_in(ma);
             ssh_ecdhkex_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
             put_string(s->exhash, pubpoint->u, pubpoint->len);
-            strbuf_free(pubpoint);
+            memarena_free(ma);
         }
 
         {
@@ -25,6 +25,11 @@ void ssh2_transport_provide_hostkeys(PacketProtocolLayer *ppl,
     s->nhostkeys = nhostkeys;
 }
 
+void ssh2kex_precompute_next(struct ssh2_transport_state *s)
+{
+    /* The server makes its ephemeral keys when it needs them */
+}
+
 static strbuf *finalise_and_sign_exhash(struct ssh2_transport_state *s)
 {
     strbuf *sb;
@@ -229,10 +234,12 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
         pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_REPLY);
         put_stringpl(pktout, s->hostkeydata);
         {
-            strbuf *pubpoint = strbuf_new();
+            memarena *ma = memarena_new();
+            strbuf *pubpoint = strbuf_new_in(ma);
             ssh_ecdhkex_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
             put_string(s->exhash, pubpoint->u, pubpoint->len);
             put_stringsb(pktout, pubpoint);
+            memarena_free(ma);
         }
         put_stringsb(pktout, finalise_and_sign_exhash(s));
         pq_push(s->ppl.out_pq, pktout);
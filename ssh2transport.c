@@ -26,7 +26,7 @@ const static ssh2_macalg *const buggymacs[] = {
     &ssh_hmac_sha1_buggy, &ssh_hmac_sha1_96_buggy, &ssh_hmac_md5
 };
 
-static ssh_compressor *ssh_comp_none_init(void)
+static ssh_compressor *ssh_comp_none_init(int level)
 {
     return NULL;
 }
@@ -64,7 +64,7 @@ static const ssh_compression_alg ssh_comp_none = {
     .text_name = NULL,
 };
 const static ssh_compression_alg *const compressions[] = {
-    &ssh_zlib, &ssh_comp_none
+    &ssh_zlib, &ssh_lz4, &ssh_comp_none
 };
 
 static void ssh2_transport_free(PacketProtocolLayer *);
@@ -600,7 +600,8 @@ static void ssh2_write_kexinit_lists(
      * Set up preferred compression.
      */
     if (conf_get_bool(conf, CONF_compression))
-        preferred_comp = &ssh_zlib;
+        preferred_comp = (conf_get_bool(conf, CONF_compression_lz4) ?
+                          &ssh_lz4 : &ssh_zlib);
     else
         preferred_comp = &ssh_comp_none;
 
@@ -1190,7 +1191,7 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      */
     strbuf_clear(s->client_kexinit);
     put_byte(s->outgoing_kexinit, SSH2_MSG_KEXINIT);
-    random_read(strbuf_append(s->outgoing_kexinit, 16), 16);
+    random_read_fast(strbuf_append(s->outgoing_kexinit, 16), 16);
     ssh2_write_kexinit_lists(
         BinarySink_UPCAST(s->outgoing_kexinit), s->kexlists,
         s->conf, s->ssc, s->ppl.remote_bugs,
@@ -1415,9 +1416,10 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      * session keys.
      */
     {
-        strbuf *cipher_key = strbuf_new_nm();
-        strbuf *cipher_iv = strbuf_new_nm();
-        strbuf *mac_key = strbuf_new_nm();
+        memarena *ma = memarena_new();
+        strbuf *cipher_key = strbuf_new_in(ma);
+        strbuf *cipher_iv = strbuf_new_in(ma);
+        strbuf *mac_key = strbuf_new_in(ma);
 
         if (s->out.cipher) {
             ssh2_mkkey(s, cipher_iv, s->K, s->exchange_hash,
@@ -1435,11 +1437,10 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
             s->ppl.bpp,
             s->out.cipher, cipher_key->u, cipher_iv->u,
             s->out.mac, s->out.etm_mode, mac_key->u,
-            s->out.comp, s->out.comp_delayed);
+            s->out.comp, s->out.comp_delayed,
+            conf_get_int(s->conf, CONF_compression_level));
 
-        strbuf_free(cipher_key);
-        strbuf_free(cipher_iv);
-        strbuf_free(mac_key);
+        memarena_free(ma);             /* wipes the keys */
     }
 
     /*
@@ -1449,7 +1450,8 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
     if (!s->post_newkeys_ext_info) {
         s->post_newkeys_ext_info = true; /* never do this again */
         if (s->can_send_ext_info) {
-            strbuf *extinfo = strbuf_new();
+            memarena *ma = memarena_new();
+            strbuf *extinfo = strbuf_new_in(ma);
             uint32_t n_exts = 0;
 
             if (s->ssc) {
@@ -1457,7 +1459,7 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
                  * key algorithms. */
                 n_exts++;
                 put_stringz(extinfo, "server-sig-algs");
-                strbuf *list = strbuf_new();
+                strbuf *list = strbuf_new_in(ma);
                 for (size_t i = 0; i < n_keyalgs; i++)
                     add_to_commasep(list, all_keyalgs[i]->ssh_id);
                 put_stringsb(extinfo, list);
@@ -1474,7 +1476,7 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
                 pq_push(s->ppl.out_pq, pktout);
             }
 
-            strbuf_free(extinfo);
+            memarena_free(ma);
         }
     }
 
@@ -1506,9 +1508,10 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      * incoming session keys.
      */
     {
-        strbuf *cipher_key = strbuf_new_nm();
-        strbuf *cipher_iv = strbuf_new_nm();
-        strbuf *mac_key = strbuf_new_nm();
+        memarena *ma = memarena_new();
+        strbuf *cipher_key = strbuf_new_in(ma);
+        strbuf *cipher_iv = strbuf_new_in(ma);
+        strbuf *mac_key = strbuf_new_in(ma);
 
         if (s->in.cipher) {
             ssh2_mkkey(s, cipher_iv, s->K, s->exchange_hash,
@@ -1528,9 +1531,7 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
             s->in.mac, s->in.etm_mode, mac_key->u,
             s->in.comp, s->in.comp_delayed);
 
-        strbuf_free(cipher_key);
-        strbuf_free(cipher_iv);
-        strbuf_free(mac_key);
+        memarena_free(ma);             /* wipes the keys */
     }
 
     /*
@@ -1559,6 +1560,7 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      * Otherwise, schedule a timer for our next rekey.
      */
     s->kex_in_progress = false;
+    s->next_kex_precomputed = false;
     s->last_rekey = GETTICKCOUNT();
     (void) ssh2_transport_timer_update(s, 0);
 
@@ -1670,6 +1672,10 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
             } else if (s->stats->out.expired) {
                 s->rekey_reason = "too much data sent";
                 s->rekey_class = RK_NORMAL;
+            } else if (dts_nearly_expired(&s->stats->in, s->max_data_size) ||
+                       dts_nearly_expired(&s->stats->out, s->max_data_size)) {
+                /* Not yet, but it won't be long */
+                ssh2kex_precompute_next(s);
             }
         }
 
@@ -1752,6 +1758,14 @@ static void ssh2_transport_timer(void *ctx, unsigned long now)
     (void) ssh2_transport_timer_update(s, 0);
 }
 
+static void ssh2_transport_precompute_timer(void *ctx, unsigned long now)
+{
+    struct ssh2_transport_state *s = (struct ssh2_transport_state *)ctx;
+
+    if (now == s->next_precompute)
+        ssh2kex_precompute_next(s);
+}
+
 /*
  * The rekey_time is zero except when re-configuring.
  *
@@ -1783,6 +1797,19 @@ static bool ssh2_transport_timer_update(struct ssh2_transport_state *s,
         ticks = next - now;
     }
 
+    /*
+     * ticks is now the time until the next rekey for a timeout, so
+     * arrange to get ready for it a little beforehand. Most
+     * connections never rekey at all, so there's no point doing that
+     * as soon as the previous key exchange is over.
+     */
+    if (s->kex_precomp && mins > 0) {
+        unsigned long lead = KEX_PRECOMP_LEAD * TICKSPERSEC;
+        s->next_precompute = schedule_timer(
+            ticks > lead ? ticks - lead : 0,
+            ssh2_transport_precompute_timer, s);
+    }
+
 #ifndef NO_GSSAPI
     if (s->gss_kex_used) {
         /*
@@ -2095,8 +2122,12 @@ static void ssh2_transport_reconfigure(PacketProtocolLayer *ppl, Conf *conf)
         }
     }
 
+    /* The choice of LZ4 only matters if compression is on at all */
     if (conf_get_bool(s->conf, CONF_compression) !=
-        conf_get_bool(conf, CONF_compression)) {
+        conf_get_bool(conf, CONF_compression) ||
+        (conf_get_bool(conf, CONF_compression) &&
+         conf_get_bool(s->conf, CONF_compression_lz4) !=
+         conf_get_bool(conf, CONF_compression_lz4))) {
         rekey_reason = "compression setting changed";
         rekey_mandatory = true;
     }
@@ -19,6 +19,9 @@
 #define DH_MAX_SIZE 8192
 
 #define MAXKEXLIST 16
+
+/* How long before a timed rekey the client makes its new DH/ECDH key */
+#define KEX_PRECOMP_LEAD 60     /* seconds */
 struct kexinit_algorithm {
     const char *name;
     union {
@@ -144,6 +147,12 @@ struct ssh2_transport_state {
 
     bool kex_in_progress;
     unsigned long next_rekey, last_rekey;
+
+    /* Client only: where to get our half of the next key exchange
+     * made in advance, once we can see it coming */
+    kex_precomp_cache *kex_precomp;
+    bool next_kex_precomputed;
+    unsigned long next_precompute;
     const char *deferred_rekey_reason;
     bool higher_layer_ok;
 
@@ -233,6 +242,10 @@ struct ssh2_transport_state {
 PktIn *ssh2_transport_pop(struct ssh2_transport_state *s);
 void ssh2_transport_dialog_callback(void *, int);
 
+/* Provided by kex for use in transport: on the client, get our half
+ * of the next key exchange made in advance, once a rekey is coming */
+void ssh2kex_precompute_next(struct ssh2_transport_state *s);
+
 /* Provided by transport for use in kex */
 void ssh2transport_finalise_exhash(struct ssh2_transport_state *s);
 
@@ -993,6 +993,7 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
 
                 if (key) {
                     strbuf *pkblob, *sigdata, *sigblob;
+                    memarena *ma;
 
                     /*
                      * We have loaded the private key and the server
@@ -1006,7 +1007,8 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                     put_stringz(s->pktout, "publickey"); /* method */
                     put_bool(s->pktout, true); /* signature follows */
                     put_stringz(s->pktout, s->publickey_algorithm);
-                    pkblob = strbuf_new();
+                    ma = memarena_new();
+                    pkblob = strbuf_new_in(ma);
                     ssh_key_public_blob(key->key, BinarySink_UPCAST(pkblob));
                     put_string(s->pktout, pkblob->s, pkblob->len);
 
@@ -1018,19 +1020,17 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                      * followed by everything so far placed in the
                      * outgoing packet.
                      */
-                    sigdata = strbuf_new();
+                    sigdata = strbuf_new_in(ma);
                     ssh2_userauth_add_session_id(s, sigdata);
                     put_data(sigdata, s->pktout->data + 5,
                              s->pktout->length - 5);
-                    sigblob = strbuf_new();
+                    sigblob = strbuf_new_in(ma);
                     ssh_key_sign(key->key, ptrlen_from_strbuf(sigdata),
                                  s->signflags, BinarySink_UPCAST(sigblob));
-                    strbuf_free(sigdata);
                     ssh2_userauth_add_sigblob(
                         s, s->pktout, ptrlen_from_strbuf(pkblob),
                         ptrlen_from_strbuf(sigblob));
-                    strbuf_free(pkblob);
-                    strbuf_free(sigblob);
+                    memarena_free(ma);
 
                     pq_push(s->ppl.out_pq, s->pktout);
                     ppl_logevent("Sent public key signature");
@@ -75,6 +75,33 @@ void ssh1_bpp_start_compression(BinaryPacketProtocol *bpp);
  * up in_pq and out_pq, and initialising input_consumer. */
 void ssh_bpp_common_setup(BinaryPacketProtocol *);
 
+/*
+ * Helpers for the BPP's owner, to schedule writing out_raw to the
+ * network. Rather than writing whenever the BPP has produced some
+ * output, the owner's flush callback should put itself off (by
+ * re-queueing itself) for as long as ssh_flush_should_defer says so,
+ * which is while other toplevel callbacks are still waiting to run
+ * and might produce more packets. Then a burst of packets, e.g. from
+ * many busy channels at once, goes out in one write. The delay is
+ * capped at SSH_FLUSH_MAX_DELAY, and a lone packet on an otherwise
+ * idle connection (such as a keystroke) isn't delayed at all.
+ *
+ * ssh_flush_next_chunk returns the next piece of out_raw to pass to
+ * sk_write, gathering several bufchain granules into 'batch' if
+ * necessary so that a whole burst is one write. The caller consumes
+ * the returned length from out_raw once it's been written.
+ */
+typedef struct SshFlushSched {
+    bool deferring;
+    unsigned long since;
+    unsigned deferrals;
+} SshFlushSched;
+#define SSH_FLUSH_MAX_DELAY (TICKSPERSEC / 200)
+#define SSH_FLUSH_MAX_DEFERRALS 64
+#define SSH_FLUSH_BATCH_MAX 65536
+bool ssh_flush_should_defer(SshFlushSched *fs, bufchain *out_raw);
+ptrlen ssh_flush_next_chunk(bufchain *out_raw, strbuf *batch);
+
 /* Common helper functions between the SSH-2 full and bare BPPs */
 void ssh2_bpp_queue_disconnect(BinaryPacketProtocol *bpp,
                                const char *msg, int category);
@@ -131,6 +158,12 @@ static inline void dts_reset(struct DataTransferStatsDirection *s,
      */
     s->running = (starting_size != 0);
 }
+/* True once less than an eighth of the starting allowance is left */
+static inline bool dts_nearly_expired(
+    const struct DataTransferStatsDirection *s, unsigned long starting_size)
+{
+    return s->running && s->remaining < starting_size / 8;
+}
 
 BinaryPacketProtocol *ssh2_bpp_new(
     LogContext *logctx, struct DataTransferStats *stats, bool is_server);
@@ -138,7 +171,8 @@ void ssh2_bpp_new_outgoing_crypto(
     BinaryPacketProtocol *bpp,
     const ssh_cipheralg *cipher, const void *ckey, const void *iv,
     const ssh2_macalg *mac, bool etm_mode, const void *mac_key,
-    const ssh_compression_alg *compression, bool delayed_compression);
+    const ssh_compression_alg *compression, bool delayed_compression,
+    int compression_level);
 void ssh2_bpp_new_incoming_crypto(
     BinaryPacketProtocol *bpp,
     const ssh_cipheralg *cipher, const void *ckey, const void *iv,
@@ -156,6 +190,14 @@ void ssh2_bpp_new_incoming_crypto(
  */
 bool ssh2_bpp_rekey_inadvisable(BinaryPacketProtocol *bpp);
 
+/*
+ * Hand the packet encryption and decryption of an SSH-2 BPP to worker
+ * threads. finish_crypto_thread waits for (or takes back) anything
+ * they're still doing, and is a no-op for any other kind of BPP.
+ */
+void ssh2_bpp_enable_crypto_thread(BinaryPacketProtocol *bpp);
+void ssh2_bpp_finish_crypto_thread(BinaryPacketProtocol *bpp);
+
 BinaryPacketProtocol *ssh2_bare_bpp_new(LogContext *logctx);
 
 /*
@@ -178,6 +178,29 @@ static INLINE void chacha20_decrypt(struct chacha20 *ctx,
     chacha20_encrypt(ctx, blk, len);
 }
 
+/*
+ * Plain ChaCha20 keystream from a 256-bit key, with the nonce and
+ * block counter starting at zero. Used by the random pool in
+ * sshrand.c.
+ */
+void chacha20_keystream(const void *key, void *vout, size_t len)
+{
+    static const unsigned char zero_iv[8];
+    unsigned char *out = (unsigned char *)vout;
+    struct chacha20 ctx;
+
+    chacha20_key(&ctx, key);
+    chacha20_iv(&ctx, zero_iv);
+    while (len > 0) {
+        size_t thislen = len < 64 ? len : 64;
+        chacha20_round(&ctx);
+        memcpy(out, ctx.current, thislen);
+        out += thislen;
+        len -= thislen;
+    }
+    smemclr(&ctx, sizeof(ctx));
+}
+
 /* Poly1305 implementation (no AES, nonce is not encrypted) */
 
 #define NWORDS ((130 + BIGNUM_INT_BITS-1) / BIGNUM_INT_BITS)
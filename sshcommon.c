@@ -271,6 +271,20 @@ static void ssh_pkt_BinarySink_write(BinarySink *bs,
     ssh_pkt_adddata(pkt, data, len);
 }
 
+/*
+ * Make room in advance for 'len' more bytes of payload, and for the
+ * padding and MAC the BPP will append, so that a large packet
+ * assembled in one go isn't reallocated (and, since packet storage
+ * is never moved without being wiped, copied) on its way out.
+ */
+#define PKTOUT_TRAILER_RESERVE 512
+
+void ssh_pkt_reserve(PktOut *pkt, size_t len)
+{
+    sgrowarrayn_nm(pkt->data, pkt->maxlen, pkt->length,
+                   len + PKTOUT_TRAILER_RESERVE);
+}
+
 void ssh_free_pktout(PktOut *pkt)
 {
     sfree(pkt->data);
@@ -776,6 +790,53 @@ void ssh_bpp_free(BinaryPacketProtocol *bpp)
     bpp->vt->free(bpp);
 }
 
+bool ssh_flush_should_defer(SshFlushSched *fs, bufchain *out_raw)
+{
+    size_t queued = bufchain_size(out_raw);
+
+    if (queued > 0 && queued < SSH_FLUSH_BATCH_MAX &&
+        toplevel_callbacks_waiting()) {
+        unsigned long now = GETTICKCOUNT();
+
+        if (!fs->deferring) {
+            fs->deferring = true;
+            fs->since = now;
+            fs->deferrals = 0;
+        }
+
+        /*
+         * Count deferrals as well as time, in case something keeps
+         * the callback queue permanently non-empty and the clock
+         * doesn't tick over between goes.
+         */
+        if (now - fs->since < SSH_FLUSH_MAX_DELAY &&
+            fs->deferrals++ < SSH_FLUSH_MAX_DEFERRALS)
+            return true;
+    }
+
+    fs->deferring = false;
+    return false;
+}
+
+ptrlen ssh_flush_next_chunk(bufchain *out_raw, strbuf *batch)
+{
+    ptrlen data = bufchain_prefix(out_raw);
+    size_t len;
+
+    /*
+     * A big granule (e.g. bulk channel data) is worth a write of its
+     * own, and isn't worth copying. Otherwise, if there's more than
+     * one granule, copy as much as we sensibly can into one piece.
+     */
+    if (data.len >= SSH_FLUSH_BATCH_MAX || data.len == bufchain_size(out_raw))
+        return data;
+
+    len = min(bufchain_size(out_raw), SSH_FLUSH_BATCH_MAX);
+    strbuf_clear(batch);
+    bufchain_fetch(out_raw, strbuf_append(batch, len), len);
+    return ptrlen_from_strbuf(batch);
+}
+
 void ssh2_bpp_queue_disconnect(BinaryPacketProtocol *bpp,
                                const char *msg, int category)
 {
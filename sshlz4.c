@@ -0,0 +1,377 @@
+/*
+ * A fast byte-oriented compression method for SSH-2, modelled on the
+ * LZ4 block format. It's only offered under a PuTTY-specific name, so
+ * it will only ever be used between PuTTY and its own servers
+ * (psusan and Uppity), where it's useful on a fast link for which
+ * zlib can't keep up.
+ *
+ * Each packet payload is compressed into a sequence of 'sequences',
+ * each of which consists of some literal bytes and then a match
+ * against earlier data:
+ *
+ *  - a token byte, whose top 4 bits give the number of literals and
+ *    whose bottom 4 bits give the match length minus 4
+ *  - if the literal count field is 15, further bytes which are added
+ *    to it, continuing as long as each one is 255
+ *  - the literal bytes themselves
+ *  - a 2-byte little-endian match offset, from 1 to 65535
+ *  - if the match length field is 15, further bytes which are added
+ *    to it, in the same way as for the literal count.
+ *
+ * The payload ends after the literals of its last sequence, which
+ * therefore has no match. Matches may refer back into previous
+ * packets, so the compressor and decompressor each keep the last 64K
+ * of data as a dictionary.
+ *
+ * One departure from LZ4 proper: an offset of zero means there is no
+ * match, and requires the match length field to be zero. This lets
+ * the compressor pad its output to a requested minimum length, by
+ * appending zero bytes after the final literals.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "defs.h"
+#include "ssh.h"
+
+#define LZ4_WINDOW 65535                /* furthest back a match can go */
+#define LZ4_MINMATCH 4
+#define LZ4_HASHBITS 14
+
+/*
+ * How much history to let the buffers accumulate before sliding the
+ * most recent window's worth back down to the bottom.
+ */
+#define LZ4_SLIDE_THRESHOLD (4 * LZ4_WINDOW)
+
+/*
+ * Once the compressor has failed to find a match this many times in
+ * a row, it starts stepping over the input faster, so as to get
+ * through incompressible data quickly.
+ */
+#define LZ4_SKIP_TRIGGER 6
+
+/*
+ * Refuse to produce more than this much output from one packet, so
+ * that a hostile peer can't make us allocate without limit.
+ */
+#define LZ4_MAX_OUTPUT 0x100000
+
+static inline unsigned lz4_hash(const unsigned char *p)
+{
+    return (uint32_t)(GET_32BIT_LSB_FIRST(p) * 0x9E3779B1U) >>
+        (32 - LZ4_HASHBITS);
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t n)
+{
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = n;
+    return op;
+}
+
+/* ----------------------------------------------------------------------
+ * Compression.
+ */
+
+struct ssh_lz4_compressor {
+    unsigned char *buf;         /* history, followed by the current block */
+    size_t buflen, bufsize;
+    uint32_t base;              /* stream position of buf[0] */
+    uint32_t table[1 << LZ4_HASHBITS]; /* stream positions, by hash */
+    ssh_compressor sc;
+};
+
+ssh_compressor *lz4_compress_init(int level)
+{
+    struct ssh_lz4_compressor *comp = snew(struct ssh_lz4_compressor);
+
+    /* There's only one way to do it, so we ignore 'level'. */
+    comp->buf = NULL;
+    comp->buflen = comp->bufsize = 0;
+    comp->base = 0;
+    memset(comp->table, 0, sizeof(comp->table));
+    comp->sc.vt = &ssh_lz4;
+    return &comp->sc;
+}
+
+void lz4_compress_cleanup(ssh_compressor *sc)
+{
+    struct ssh_lz4_compressor *comp =
+        container_of(sc, struct ssh_lz4_compressor, sc);
+    if (comp->buf) {
+        smemclr(comp->buf, comp->bufsize);
+        sfree(comp->buf);
+    }
+    smemclr(comp, sizeof(*comp));
+    sfree(comp);
+}
+
+static unsigned char *lz4_put_sequence(
+    unsigned char *op, const unsigned char *lit, size_t nlit,
+    unsigned offset, size_t mlen)
+{
+    size_t mcode = mlen - LZ4_MINMATCH;
+
+    *op++ = (nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15);
+    if (nlit >= 15)
+        op = lz4_put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if (mcode >= 15)
+        op = lz4_put_length(op, mcode - 15);
+    return op;
+}
+
+void lz4_compress_block(ssh_compressor *sc,
+                        const unsigned char *block, int len,
+                        unsigned char **outblock, int *outlen,
+                        int minlen)
+{
+    struct ssh_lz4_compressor *comp =
+        container_of(sc, struct ssh_lz4_compressor, sc);
+    unsigned char *buf, *op, *ostart;
+    size_t pos, end, anchor, bound, nlit;
+    unsigned misses = 0;
+
+    /*
+     * Append the new data to the history buffer, sliding the buffer
+     * down first if it's getting long.
+     */
+    if (comp->buflen > LZ4_SLIDE_THRESHOLD) {
+        size_t shift = comp->buflen - LZ4_WINDOW;
+        memmove(comp->buf, comp->buf + shift, LZ4_WINDOW);
+        comp->buflen = LZ4_WINDOW;
+        comp->base += shift;
+    }
+    sgrowarrayn_nm(comp->buf, comp->bufsize, comp->buflen, len);
+    memcpy(comp->buf + comp->buflen, block, len);
+    buf = comp->buf;
+    pos = anchor = comp->buflen;
+    end = comp->buflen + len;
+    comp->buflen = end;
+
+    /*
+     * Reserve enough output space for the worst case, which is
+     * everything going out as literals, plus padding.
+     */
+    bound = len + len / 255 + 16;
+    if (bound < (size_t)minlen + 3)
+        bound = minlen + 3;
+    ostart = op = snewn(bound, unsigned char);
+
+    while (pos + LZ4_MINMATCH <= end) {
+        unsigned h = lz4_hash(buf + pos);
+        uint32_t here = comp->base + pos;
+        uint32_t offset = here - comp->table[h];
+        comp->table[h] = here;
+
+        if (offset >= 1 && offset <= LZ4_WINDOW && offset <= pos &&
+            GET_32BIT_LSB_FIRST(buf + pos - offset) ==
+            GET_32BIT_LSB_FIRST(buf + pos)) {
+            size_t mlen = LZ4_MINMATCH;
+            while (pos + mlen + 4 <= end &&
+                   GET_32BIT_LSB_FIRST(buf + pos + mlen) ==
+                   GET_32BIT_LSB_FIRST(buf + pos + mlen - offset))
+                mlen += 4;
+            while (pos + mlen < end &&
+                   buf[pos + mlen] == buf[pos + mlen - offset])
+                mlen++;
+
+            op = lz4_put_sequence(op, buf + anchor, pos - anchor,
+                                  offset, mlen);
+            pos += mlen;
+            anchor = pos;
+            misses = 0;
+
+            /* Index a position near the end of the match too, which
+             * is cheap and often finds the next one. */
+            if (pos + LZ4_MINMATCH <= end)
+                comp->table[lz4_hash(buf + pos - 2)] = comp->base + pos - 2;
+        } else {
+            pos += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+        }
+    }
+
+    /*
+     * The final literals, with no match.
+     */
+    nlit = end - anchor;
+    *op++ = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15)
+        op = lz4_put_length(op, nlit - 15);
+    memcpy(op, buf + anchor, nlit);
+    op += nlit;
+
+    /*
+     * Pad with a zero offset, meaning 'no match', followed by as many
+     * empty sequences as necessary. A run of zeros parses as
+     * alternating 2-byte offsets and 1-byte tokens, so its length
+     * mustn't leave half an offset at the end.
+     */
+    if (op - ostart < minlen) {
+        size_t npad = minlen - (op - ostart);
+        if (npad < 2)
+            npad = 2;
+        if (npad % 3 == 1)
+            npad++;
+        memset(op, 0, npad);
+        op += npad;
+    }
+
+    assert(op - ostart <= bound);
+    *outlen = op - ostart;
+    *outblock = ostart;
+}
+
+/* ----------------------------------------------------------------------
+ * Decompression.
+ */
+
+struct ssh_lz4_decompressor {
+    unsigned char *buf;         /* history, followed by the current block */
+    size_t buflen, bufsize;
+    ssh_decompressor dc;
+};
+
+ssh_decompressor *lz4_decompress_init(void)
+{
+    struct ssh_lz4_decompressor *dctx = snew(struct ssh_lz4_decompressor);
+    dctx->buf = NULL;
+    dctx->buflen = dctx->bufsize = 0;
+    dctx->dc.vt = &ssh_lz4;
+    return &dctx->dc;
+}
+
+void lz4_decompress_cleanup(ssh_decompressor *dc)
+{
+    struct ssh_lz4_decompressor *dctx =
+        container_of(dc, struct ssh_lz4_decompressor, dc);
+    if (dctx->buf) {
+        smemclr(dctx->buf, dctx->bufsize);
+        sfree(dctx->buf);
+    }
+    sfree(dctx);
+}
+
+/*
+ * Read an extended length field, adding it to *n. Returns false if
+ * the input runs out, or if the total is implausibly large.
+ */
+static bool lz4_get_length(const unsigned char **ipp,
+                           const unsigned char *iend, size_t *n)
+{
+    const unsigned char *ip = *ipp;
+    unsigned char c;
+
+    do {
+        if (ip >= iend || *n > LZ4_MAX_OUTPUT)
+            return false;
+        c = *ip++;
+        *n += c;
+    } while (c == 255);
+
+    *ipp = ip;
+    return true;
+}
+
+bool lz4_decompress_block(ssh_decompressor *dc,
+                          const unsigned char *block, int len,
+                          unsigned char **outblock, int *outlen)
+{
+    struct ssh_lz4_decompressor *dctx =
+        container_of(dc, struct ssh_lz4_decompressor, dc);
+    const unsigned char *ip = block, *iend = block + len;
+    size_t start, op;
+
+    if (dctx->buflen > LZ4_SLIDE_THRESHOLD) {
+        memmove(dctx->buf, dctx->buf + dctx->buflen - LZ4_WINDOW,
+                LZ4_WINDOW);
+        dctx->buflen = LZ4_WINDOW;
+    }
+    start = op = dctx->buflen;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4, mlen = token & 15, offset;
+
+        if (nlit == 15 && !lz4_get_length(&ip, iend, &nlit))
+            goto decode_error;
+        if (nlit > iend - ip || op - start + nlit > LZ4_MAX_OUTPUT)
+            goto decode_error;
+        if (op + nlit > dctx->bufsize)
+            sgrowarrayn_nm(dctx->buf, dctx->bufsize, op, nlit);
+        if (nlit)                      /* buf may still be NULL */
+            memcpy(dctx->buf + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend)
+            break;                     /* final sequence has no match */
+
+        if (iend - ip < 2)
+            goto decode_error;
+        offset = GET_16BIT_LSB_FIRST(ip);
+        ip += 2;
+
+        if (offset == 0) {
+            /* No match; this is padding, or a sequence of literals
+             * that didn't happen to be the last. */
+            if (mlen != 0)
+                goto decode_error;
+            continue;
+        }
+
+        if (mlen == 15 && !lz4_get_length(&ip, iend, &mlen))
+            goto decode_error;
+        mlen += LZ4_MINMATCH;
+        if (offset > op || op - start + mlen > LZ4_MAX_OUTPUT)
+            goto decode_error;
+
+        if (op + mlen > dctx->bufsize)
+            sgrowarrayn_nm(dctx->buf, dctx->bufsize, op, mlen);
+        if (offset >= mlen) {
+            memcpy(dctx->buf + op, dctx->buf + op - offset, mlen);
+            op += mlen;
+        } else {
+            /* The match overlaps itself, so copy a byte at a time. */
+            unsigned char *dst = dctx->buf + op;
+            const unsigned char *src = dst - offset;
+            size_t i;
+            for (i = 0; i < mlen; i++)
+                dst[i] = src[i];
+            op += mlen;
+        }
+    }
+
+    dctx->buflen = op;
+    *outlen = op - start;
+    *outblock = snewn(*outlen + 1, unsigned char);
+    if (*outlen)
+        memcpy(*outblock, dctx->buf + start, *outlen);
+    return true;
+
+  decode_error:
+    *outblock = NULL;
+    *outlen = 0;
+    return false;
+}
+
+const ssh_compression_alg ssh_lz4 = {
+    .name = "lz4@putty.projects.tartarus.org",
+    .delayed_name = NULL,
+    .compress_new = lz4_compress_init,
+    .compress_free = lz4_compress_cleanup,
+    .compress = lz4_compress_block,
+    .decompress_new = lz4_decompress_init,
+    .decompress_free = lz4_decompress_cleanup,
+    .decompress = lz4_decompress_block,
+    .text_name = "LZ4-style (PuTTY-specific)",
+};
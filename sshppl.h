@@ -171,4 +171,9 @@ void ssh1_compute_session_id(
 void ssh2_transport_provide_hostkeys(PacketProtocolLayer *ssh2_transport_ptr,
                                      ssh_key *const *hostkeys, int nhostkeys);
 
+/* Method used by the SSH client, to share its connection's cache of
+ * precomputed key exchange keys (owned by ssh.c) */
+void ssh2_transport_provide_kex_precomp(
+    PacketProtocolLayer *ssh2_transport_ptr, kex_precomp_cache *kpc);
+
 #endif /* PUTTY_SSHPPL_H */
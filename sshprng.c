@@ -285,3 +285,9 @@ size_t prng_seed_bits(prng *pr)
     prng_impl *pi = container_of(pr, prng_impl, Prng);
     return pi->hashalg->hlen * 8;
 }
+
+uint32_t prng_entropy_reseeds(prng *pr)
+{
+    prng_impl *pi = container_of(pr, prng_impl, Prng);
+    return pi->reseeds;
+}
@@ -22,6 +22,8 @@ typedef struct server server;
 struct server {
     bufchain in_raw, out_raw;
     IdempotentCallback ic_out_raw;
+    SshFlushSched flush;
+    strbuf *out_batch;
     bool pending_close;
 
     bufchain dummy_user_input;     /* we never put anything on this */
@@ -72,6 +74,8 @@ void share_activate(ssh_sharing_state *sharestate,
 void ssh_connshare_provide_connlayer(ssh_sharing_state *sharestate,
                                      ConnectionLayer *cl) {}
 int share_ndownstreams(ssh_sharing_state *sharestate) { return 0; }
+const bool share_can_persist = false;
+int ssh_share_detach(Ssh *ssh) { return SHARE_DETACH_FAILED; }
 void share_got_pkt_from_server(ssh_sharing_connstate *cs, int type,
                                const void *vpkt, int pktlen) {}
 void share_setup_x11_channel(ssh_sharing_connstate *cs, share_channel *chan,
@@ -164,20 +168,23 @@ static void server_receive(
 
 static void server_sent(Plug *plug, size_t bufsize)
 {
-#ifdef FIXME
     server *srv = container_of(plug, server, plug);
 
     /*
      * If the send backlog on the SSH socket itself clears, we should
      * unthrottle the whole world if it was throttled. Also trigger an
      * extra call to the consumer of the BPP's output, to try to send
-     * some more data off its bufchain.
+     * some more data off its bufchain. (That part isn't optional:
+     * server_bpp_output_raw_data_callback stops early when the
+     * backlog is large, and nothing else will restart it if no more
+     * packets are generated.)
      */
     if (bufsize < SSH_MAX_BACKLOG) {
+#ifdef FIXME
         srv_throttle_all(srv, 0, bufsize);
+#endif
         queue_idempotent_callback(&srv->ic_out_raw);
     }
-#endif
 }
 
 LogContext *ssh_get_logctx(Ssh *ssh)
@@ -270,6 +277,7 @@ Plug *ssh_server_plug(
     bufchain_init(&srv->in_raw);
     bufchain_init(&srv->out_raw);
     bufchain_init(&srv->dummy_user_input);
+    srv->out_batch = strbuf_new_nm();
 
 #ifndef NO_GSSAPI
     /* FIXME: replace with sensible */
@@ -318,6 +326,7 @@ static void ssh_server_free_callback(void *vsrv)
     bufchain_clear(&srv->in_raw);
     bufchain_clear(&srv->out_raw);
     bufchain_clear(&srv->dummy_user_input);
+    strbuf_free(srv->out_batch);
 
     if (srv->socket)
         sk_close(srv->socket);
@@ -376,10 +385,16 @@ static void server_bpp_output_raw_data_callback(void *vctx)
     if (!srv->socket)
         return;
 
+    if (!srv->pending_close &&
+        ssh_flush_should_defer(&srv->flush, &srv->out_raw)) {
+        queue_idempotent_callback(&srv->ic_out_raw);
+        return;
+    }
+
     while (bufchain_size(&srv->out_raw) > 0) {
         size_t backlog;
 
-        ptrlen data = bufchain_prefix(&srv->out_raw);
+        ptrlen data = ssh_flush_next_chunk(&srv->out_raw, srv->out_batch);
 
         if (srv->logctx)
             log_packet(srv->logctx, PKT_OUTGOING, -1, NULL, data.ptr, data.len,
@@ -516,6 +531,8 @@ static void server_got_ssh_version(struct ssh_version_receiver *rcv,
         PacketProtocolLayer *userauth_layer, *transport_child_layer;
 
         srv->bpp = ssh2_bpp_new(srv->logctx, &srv->stats, true);
+        if (conf_get_bool(srv->conf, CONF_ssh_crypto_thread))
+            ssh2_bpp_enable_crypto_thread(srv->bpp);
         server_connect_bpp(srv);
 
         connection_layer = ssh2_connection_new(
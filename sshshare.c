@@ -147,6 +147,8 @@ struct ssh_sharing_state {
     unsigned nextid;                 /* preferred id for next connstate */
     ConnectionLayer *cl;             /* instance of the ssh connection layer */
     char *server_verstring;          /* server version string after "SSH-" */
+    bool disowned;                   /* listening socket now belongs to
+                                      * a background process */
 
     Plug plug;
 };
@@ -167,6 +169,8 @@ struct ssh_sharing_connstate {
     unsigned char recvbuf[0x4010];
     size_t recvlen;
 
+    strbuf *outbuf;        /* reused for each packet we send downstream */
+
     /*
      * Assorted state we have to remember about this downstream, so
      * that we can clean it up appropriately when the downstream goes
@@ -507,6 +511,7 @@ static void share_connstate_free(struct ssh_sharing_connstate *cs)
     if (cs->sock)
         sk_close(cs->sock);
 
+    strbuf_free(cs->outbuf);
     sfree(cs);
 }
 
@@ -514,7 +519,8 @@ void sharestate_free(ssh_sharing_state *sharestate)
 {
     struct ssh_sharing_connstate *cs;
 
-    platform_ssh_share_cleanup(sharestate->sockname);
+    if (!sharestate->disowned)
+        platform_ssh_share_cleanup(sharestate->sockname);
 
     while ((cs = (struct ssh_sharing_connstate *)
             delpos234(sharestate->connections, 0)) != NULL) {
@@ -732,6 +738,27 @@ static PRINTF_LIKE(2, 3) void log_general(struct ssh_sharing_state *sharestate,
     sfree(buf);
 }
 
+/*
+ * Packets to downstream are all built in cs->outbuf, which we keep
+ * between packets rather than allocating a fresh one each time.
+ */
+static strbuf *share_outbuf_start(struct ssh_sharing_connstate *cs, int type)
+{
+    strbuf *packet = cs->outbuf;
+    put_uint32(packet, 0);             /* placeholder for length field */
+    put_byte(packet, type);
+    return packet;
+}
+
+static void share_outbuf_send(struct ssh_sharing_connstate *cs)
+{
+    strbuf *packet = cs->outbuf;
+    PUT_32BIT_MSB_FIRST(packet->s, packet->len-4);
+    sk_write(cs->sock, packet->s, packet->len);
+    smemclr(packet->u, packet->len);
+    strbuf_shrink_to(packet, 0);
+}
+
 static void send_packet_to_downstream(struct ssh_sharing_connstate *cs,
                                       int type, const void *pkt, int pktlen,
                                       struct share_channel *chan)
@@ -769,30 +796,56 @@ static void send_packet_to_downstream(struct ssh_sharing_connstate *cs,
             int this_len = (data.len > chan->downstream_maxpkt ?
                             chan->downstream_maxpkt : data.len);
 
-            packet = strbuf_new_nm();
-            put_uint32(packet, 0);     /* placeholder for length field */
-            put_byte(packet, type);
+            packet = share_outbuf_start(cs, type);
             put_uint32(packet, channel);
             put_uint32(packet, this_len);
             put_data(packet, data.ptr, this_len);
             data.ptr = (const char *)data.ptr + this_len;
             data.len -= this_len;
-            PUT_32BIT_MSB_FIRST(packet->s, packet->len-4);
-            sk_write(cs->sock, packet->s, packet->len);
-            strbuf_free(packet);
+            share_outbuf_send(cs);
         } while (data.len > 0);
     } else {
         /*
          * Just do the obvious thing.
          */
-        packet = strbuf_new_nm();
-        put_uint32(packet, 0);     /* placeholder for length field */
-        put_byte(packet, type);
+        packet = share_outbuf_start(cs, type);
         put_data(packet, pkt, pktlen);
-        PUT_32BIT_MSB_FIRST(packet->s, packet->len-4);
-        sk_write(cs->sock, packet->s, packet->len);
-        strbuf_free(packet);
+        share_outbuf_send(cs);
+    }
+}
+
+/*
+ * Pass on a channel message from the server, whose first field is
+ * the recipient channel id, substituting the downstream's id for
+ * ours. This is the path taken by all the bulk data, so we build the
+ * outgoing packet directly from the incoming one rather than
+ * rewriting a copy first.
+ */
+static void send_channel_packet_to_downstream(
+    struct ssh_sharing_connstate *cs, int type,
+    const unsigned char *pkt, int pktlen, struct share_channel *chan)
+{
+    strbuf *packet;
+
+    if (!cs->sock)
+        return;
+
+    if (type == SSH2_MSG_CHANNEL_DATA &&
+        pktlen - 8 > (int)chan->downstream_maxpkt) {
+        /* Needs splitting up, which the general routine does. */
+        unsigned char *rewritten = snewn(pktlen, unsigned char);
+        memcpy(rewritten, pkt, pktlen);
+        PUT_32BIT_MSB_FIRST(rewritten, chan->downstream_id);
+        send_packet_to_downstream(cs, type, rewritten, pktlen, chan);
+        smemclr(rewritten, pktlen);
+        sfree(rewritten);
+        return;
     }
+
+    packet = share_outbuf_start(cs, type);
+    put_uint32(packet, chan->downstream_id);
+    put_data(packet, pkt + 4, pktlen - 4);
+    share_outbuf_send(cs);
 }
 
 static void share_try_cleanup(struct ssh_sharing_connstate *cs)
@@ -1168,7 +1221,6 @@ void share_got_pkt_from_server(ssh_sharing_connstate *cs, int type,
 {
     const unsigned char *pkt = (const unsigned char *)vpkt;
     struct share_globreq *globreq;
-    size_t id_pos;
     unsigned upstream_id, server_id;
     struct share_channel *chan;
     struct share_xchannel *xc;
@@ -1232,17 +1284,13 @@ void share_got_pkt_from_server(ssh_sharing_connstate *cs, int type,
          * first uint32 field in the packet. Substitute the downstream
          * channel id for our one and pass the packet downstream.
          */
-        id_pos = src->pos;
         upstream_id = get_uint32(src);
+        assert(!get_err(src));         /* ssh2connection.c has checked */
         if ((chan = share_find_channel_by_upstream(cs, upstream_id)) != NULL) {
             /*
              * The normal case: this id refers to an open channel.
              */
-            unsigned char *rewritten = snewn(pktlen, unsigned char);
-            memcpy(rewritten, pkt, pktlen);
-            PUT_32BIT_MSB_FIRST(rewritten + id_pos, chan->downstream_id);
-            send_packet_to_downstream(cs, type, rewritten, pktlen, chan);
-            sfree(rewritten);
+            send_channel_packet_to_downstream(cs, type, pkt, pktlen, chan);
 
             /*
              * Update the channel state, for messages that need it.
@@ -1752,6 +1800,25 @@ static void share_got_pkt_from_downstream(struct ssh_sharing_connstate *cs,
         len--;                                                  \
         (c) = (unsigned char)*data++;                           \
     } while (0)
+#define crWaitForData do                                        \
+    {                                                           \
+        while (len == 0) {                                      \
+            *crLine =__LINE__; return; case __LINE__:;          \
+        }                                                       \
+    } while (0)
+
+/*
+ * Packet types from downstream which share_got_pkt_from_downstream
+ * just forwards unchanged, and which can therefore be sent straight
+ * from the socket's receive buffer without copying them into
+ * cs->recvbuf first.
+ */
+static inline bool share_pkt_is_passthrough(int type)
+{
+    return (type == SSH2_MSG_CHANNEL_DATA ||
+            type == SSH2_MSG_CHANNEL_EXTENDED_DATA ||
+            type == SSH2_MSG_CHANNEL_WINDOW_ADJUST);
+}
 
 static void share_receive(Plug *plug, int urgent, const char *data, size_t len)
 {
@@ -1803,6 +1870,26 @@ static void share_receive(Plug *plug, int urgent, const char *data, size_t len)
      * Loop round reading packets.
      */
     while (1) {
+        crWaitForData;
+
+        /*
+         * Fast path: forward any complete data packets that are
+         * already in our input, directly from there.
+         */
+        while (len >= 5) {
+            size_t pktlen = GET_32BIT_MSB_FIRST(data) + (size_t)4;
+            int type = (unsigned char)data[4];
+            if (pktlen < 5 || pktlen > sizeof(cs->recvbuf) ||
+                pktlen > len || !share_pkt_is_passthrough(type))
+                break;
+            ssh_send_packet_from_downstream(cs->parent->cl, cs->id, type,
+                                            data + 5, pktlen - 5, NULL);
+            data += pktlen;
+            len -= pktlen;
+        }
+        if (len == 0)
+            continue;
+
         cs->recvlen = 0;
         while (cs->recvlen < 4) {
             crGetChar(c);
@@ -1818,8 +1905,12 @@ static void share_receive(Plug *plug, int urgent, const char *data, size_t len)
             goto dead;
         }
         while (cs->recvlen < cs->curr_packetlen) {
-            crGetChar(c);
-            cs->recvbuf[cs->recvlen++] = c;
+            crWaitForData;
+            size_t n = min(len, (size_t)cs->curr_packetlen - cs->recvlen);
+            memcpy(cs->recvbuf + cs->recvlen, data, n);
+            cs->recvlen += n;
+            data += n;
+            len -= n;
         }
 
         share_got_pkt_from_downstream(cs, cs->recvbuf[4],
@@ -1871,6 +1962,20 @@ int share_ndownstreams(ssh_sharing_state *sharestate)
     return count234(sharestate->connections);
 }
 
+/*
+ * Move a persistent upstream into a background process. In the
+ * process that's letting go of the connection, we must no longer
+ * remove the listening socket when we're freed, because the
+ * background process is still listening on it.
+ */
+int share_detach(ssh_sharing_state *sharestate, char **logtext)
+{
+    int result = platform_ssh_share_detach(sharestate->sockname, logtext);
+    if (result == SHARE_DETACH_FOREGROUND)
+        sharestate->disowned = true;
+    return result;
+}
+
 void share_activate(ssh_sharing_state *sharestate,
                     const char *server_verstring)
 {
@@ -1949,11 +2054,12 @@ static int share_listen_accepting(Plug *plug,
     cs->got_verstring = false;
     cs->recvlen = 0;
     cs->crLine = 0;
-    cs->halfchannels = newtree234(share_halfchannel_cmp);
-    cs->channels_by_us = newtree234(share_channel_us_cmp);
-    cs->channels_by_server = newtree234(share_channel_server_cmp);
-    cs->xchannels_by_us = newtree234(share_xchannel_us_cmp);
-    cs->xchannels_by_server = newtree234(share_xchannel_server_cmp);
+    cs->outbuf = strbuf_new_nm();
+    cs->halfchannels = newbtree234(share_halfchannel_cmp, false);
+    cs->channels_by_us = newbtree234(share_channel_us_cmp, true);
+    cs->channels_by_server = newbtree234(share_channel_server_cmp, false);
+    cs->xchannels_by_us = newbtree234(share_xchannel_us_cmp, false);
+    cs->xchannels_by_server = newbtree234(share_xchannel_server_cmp, false);
     cs->forwardings = newtree234(share_forwarding_cmp);
     cs->globreq_head = cs->globreq_tail = NULL;
 
@@ -2094,6 +2200,7 @@ Socket *ssh_connection_sharing_init(
     sharestate->plug.vt = &ssh_sharing_listen_plugvt;
     sharestate->listensock = NULL;
     sharestate->cl = NULL;
+    sharestate->disowned = false;
 
     /*
      * Now hand off to a per-platform routine that either connects to
@@ -2166,7 +2273,7 @@ Socket *ssh_connection_sharing_init(
 
         *state = sharestate;
         sharestate->listensock = sock;
-        sharestate->connections = newtree234(share_connstate_cmp);
+        sharestate->connections = newbtree234(share_connstate_cmp, true);
         sharestate->server_verstring = NULL;
         sharestate->sockname = sockname;
         sharestate->nextid = 1;
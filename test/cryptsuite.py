@@ -2508,6 +2508,25 @@ class standard_test_vectors(MyTestBase):
             key, plaintext, ciphertext = test.split(":")
             vector(key, plaintext, ciphertext)
 
+    def testChaCha20Keystream(self):
+        # The keystream that the random pool in sshrand.c draws on:
+        # ChaCha20 with the original 64-bit nonce and counter, both
+        # zero. With the all-zero key this is the first test vector in
+        # RFC 8439 appendix A.1 (whose 96-bit nonce and 32-bit counter
+        # happen to coincide with ours when zero), followed by its
+        # second vector, which is the same key and nonce at block 1.
+        zero = b'\0' * 32
+        stream = chacha20_keystream(zero, 128)
+        self.assertEqualBin(stream, unhex(
+            '76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7'
+            'da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586'
+            '9f07e7be5551387a98ba977c732d080dcb0f29a048e3656912c6533e32ee7aed'
+            '29b721769ce64e43d57133b074d839d531ed1f28510afb45ace10a1f4b794d6f'))
+
+        # Shorter and unaligned requests are prefixes of the same stream
+        for n in [0, 1, 31, 63, 64, 65, 100]:
+            self.assertEqualBin(chacha20_keystream(zero, n), stream[:n])
+
     def testMD5(self):
         MD5 = lambda s: hash_str('md5', s)
 
@@ -1292,6 +1292,16 @@ strbuf *argon2_wrapper(Argon2Flavour flavour, uint32_t mem, uint32_t passes,
 }
 #define argon2 argon2_wrapper
 
+strbuf *chacha20_keystream_wrapper(ptrlen key, uintmax_t len)
+{
+    if (key.len != 32)
+        fatal_error("chacha20_keystream: key must be 32 bytes long");
+    strbuf *sb = strbuf_new();
+    chacha20_keystream(key.ptr, strbuf_append(sb, len), len);
+    return sb;
+}
+#define chacha20_keystream chacha20_keystream_wrapper
+
 #define OPTIONAL_PTR_FUNC(type)                                         \
     typedef TD_val_##type TD_opt_val_##type;                            \
     static TD_opt_val_##type get_opt_val_##type(BinarySource *in) {     \
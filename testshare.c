@@ -0,0 +1,359 @@
+/*
+ * Benchmark for the connection-sharing relay in sshshare.c.
+ *
+ * This links sshshare.c against a simulated upstream connection
+ * layer and a set of simulated downstream sockets, each with one
+ * open session channel, and then pushes CHANNEL_DATA through the
+ * relay in both directions, round-robin across the downstreams. It
+ * reports the throughput in each direction, and checks that every
+ * packet comes out the other side with the right channel id.
+ *
+ * Usage: testshare [-n downstreams] [-s packet-data-size] [-m megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "putty.h"
+#include "ssh.h"
+#include "network.h"
+
+#define DOWNSTREAM_MAXPKT 0x4000
+#define SERVER_ID_BASE 0x1000
+#define DOWNSTREAM_ID_BASE 0x2000
+
+typedef struct FakeDownstream {
+    int index;
+    Socket sock;
+    Plug *plug;                        /* sshshare.c's end of it */
+    ssh_sharing_connstate *cs;
+    unsigned upstream_id, server_id, downstream_id;
+    unsigned long long bytes_in;       /* bytes sshshare.c wrote to us */
+    bool bad;
+} FakeDownstream;
+
+static FakeDownstream *downstreams;
+static int ndownstreams, setup_index;
+static unsigned next_upstream_id = 256;
+static unsigned long long bytes_to_server;
+static bool bad_to_server;
+static strbuf *server_pktout;
+
+void out_of_memory(void)
+{
+    fprintf(stderr, "Out of memory!\n");
+    exit(1);
+}
+
+/* ----------------------------------------------------------------------
+ * Stubs for things sshshare.c calls that we don't care about here.
+ */
+
+void logeventf(LogContext *ctx, const char *fmt, ...) {}
+char *get_remote_username(Conf *conf) { return NULL; }
+const bool share_can_be_downstream = false;
+const bool share_can_be_upstream = true;
+const bool share_can_persist = false;
+int platform_ssh_share_detach(const char *name, char **logtext)
+{ return SHARE_DETACH_FAILED; }
+void platform_ssh_share_cleanup(const char *name) {}
+void sk_free_peer_info(SocketPeerInfo *pi) {}
+char *x_get_default(const char *key) { return NULL; }
+int x11_identify_auth_proto(ptrlen protoname) { return -1; }
+void *x11_dehexify(ptrlen hex, int *outlen) { return NULL; }
+void *x11_make_greeting(int endian, int protomajor, int protominor,
+                        int auth_proto, const void *auth_data,
+                        int auth_len, const char *peer_ip, int peer_port,
+                        int *outlen) { return NULL; }
+
+/* ----------------------------------------------------------------------
+ * Simulated downstream sockets.
+ */
+
+static Plug *fake_plug(Socket *s, Plug *p) { return NULL; }
+static void fake_close(Socket *s) {}
+static void fake_set_frozen(Socket *s, bool is_frozen) {}
+static const char *fake_socket_error(Socket *s) { return NULL; }
+static SocketPeerInfo *fake_peer_info(Socket *s) { return NULL; }
+
+static size_t fake_write(Socket *s, const void *vdata, size_t len)
+{
+    FakeDownstream *ds = container_of(s, FakeDownstream, sock);
+    const unsigned char *data = (const unsigned char *)vdata;
+
+    /* sshshare.c writes one whole packet at a time */
+    if (len >= 9 && data[4] == SSH2_MSG_CHANNEL_DATA &&
+        GET_32BIT_MSB_FIRST(data + 5) != ds->downstream_id)
+        ds->bad = true;
+    ds->bytes_in += len;
+    return 0;
+}
+
+static const SocketVtable fake_sockvt = {
+    .plug = fake_plug,
+    .close = fake_close,
+    .write = fake_write,
+    .set_frozen = fake_set_frozen,
+    .socket_error = fake_socket_error,
+    .peer_info = fake_peer_info,
+};
+
+static Plug *listen_plug;
+static Socket listen_sock = { .vt = &fake_sockvt };
+
+int platform_ssh_share(const char *name, Conf *conf,
+                       Plug *downplug, Plug *upplug, Socket **sock,
+                       char **logtext, char **ds_err, char **us_err,
+                       bool can_upstream, bool can_downstream)
+{
+    listen_plug = upplug;
+    *sock = &listen_sock;
+    *logtext = dupstr("benchmark");
+    return SHARE_UPSTREAM;
+}
+
+static Socket *fake_accept(accept_ctx_t ctx, Plug *plug)
+{
+    FakeDownstream *ds = &downstreams[ctx.i];
+    ds->plug = plug;
+    return &ds->sock;
+}
+
+/* ----------------------------------------------------------------------
+ * Simulated upstream connection layer.
+ */
+
+static void fake_send_packet_from_downstream(
+    ConnectionLayer *cl, unsigned id, int type,
+    const void *vpkt, int pktlen, const char *additional_log_text)
+{
+    const unsigned char *pkt = (const unsigned char *)vpkt;
+
+    if (type == SSH2_MSG_CHANNEL_DATA) {
+        unsigned server_id = GET_32BIT_MSB_FIRST(pkt);
+        if (server_id < SERVER_ID_BASE ||
+            server_id >= SERVER_ID_BASE + ndownstreams)
+            bad_to_server = true;
+    }
+
+    /* The real connection layer copies each packet into a PktOut */
+    strbuf_clear(server_pktout);
+    put_data(server_pktout, pkt, pktlen);
+    bytes_to_server += pktlen;
+}
+
+static unsigned fake_alloc_sharing_channel(
+    ConnectionLayer *cl, ssh_sharing_connstate *connstate)
+{
+    FakeDownstream *ds = &downstreams[setup_index];
+    ds->cs = connstate;
+    ds->upstream_id = next_upstream_id++;
+    return ds->upstream_id;
+}
+
+static void fake_delete_sharing_channel(ConnectionLayer *cl, unsigned id) {}
+static void fake_sharing_no_more_downstreams(ConnectionLayer *cl) {}
+
+static const ConnectionLayerVtable fake_clvt = {
+    .send_packet_from_downstream = fake_send_packet_from_downstream,
+    .alloc_sharing_channel = fake_alloc_sharing_channel,
+    .delete_sharing_channel = fake_delete_sharing_channel,
+    .sharing_no_more_downstreams = fake_sharing_no_more_downstreams,
+};
+
+static ConnectionLayer fake_cl = { NULL, &fake_clvt };
+
+/* ----------------------------------------------------------------------
+ * The benchmark itself.
+ */
+
+/* Make a packet in the downstream wire format: length, type, payload */
+static void downstream_packet(strbuf *out, int type, strbuf *payload)
+{
+    put_uint32(out, payload->len + 1);
+    put_byte(out, type);
+    put_data(out, payload->s, payload->len);
+}
+
+static void setup_downstream(int i)
+{
+    static const char verstring[] =
+        "SSHCONNECTION@putty.projects.tartarus.org-2.0-testshare\r\n";
+    FakeDownstream *ds = &downstreams[i];
+    strbuf *payload = strbuf_new(), *wire = strbuf_new();
+
+    ds->index = i;
+    ds->sock.vt = &fake_sockvt;
+    ds->server_id = SERVER_ID_BASE + i;
+    ds->downstream_id = DOWNSTREAM_ID_BASE + i;
+
+    setup_index = i;
+    if (plug_accepting(listen_plug, fake_accept, (accept_ctx_t){ .i = i })) {
+        fprintf(stderr, "downstream %d was refused\n", i);
+        exit(1);
+    }
+    plug_receive(ds->plug, 0, verstring, sizeof(verstring) - 1);
+
+    /* Downstream opens a session channel... */
+    put_stringz(payload, "session");
+    put_uint32(payload, ds->downstream_id);
+    put_uint32(payload, 0x7FFFFFFF);   /* window */
+    put_uint32(payload, DOWNSTREAM_MAXPKT);
+    downstream_packet(wire, SSH2_MSG_CHANNEL_OPEN, payload);
+    plug_receive(ds->plug, 0, wire->s, wire->len);
+    assert(ds->cs);
+
+    /* ... and the server confirms it. */
+    strbuf_clear(payload);
+    put_uint32(payload, ds->upstream_id);
+    put_uint32(payload, ds->server_id);
+    put_uint32(payload, 0x7FFFFFFF);   /* window */
+    put_uint32(payload, DOWNSTREAM_MAXPKT);
+    share_got_pkt_from_server(ds->cs, SSH2_MSG_CHANNEL_OPEN_CONFIRMATION,
+                              payload->s, payload->len);
+
+    strbuf_free(payload);
+    strbuf_free(wire);
+}
+
+static double elapsed(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+    int datalen = DOWNSTREAM_MAXPKT;
+    unsigned long long target = 1024, npkts, n;
+    strbuf **from_server, **from_downstream, *payload;
+    ssh_sharing_state *state;
+    Conf *conf;
+    clock_t start;
+    double t;
+    int i, status = 0;
+
+    ndownstreams = 32;
+    server_pktout = strbuf_new_nm();
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i+1 < argc) {
+            ndownstreams = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && i+1 < argc) {
+            datalen = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-m") && i+1 < argc) {
+            target = strtoull(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: testshare [-n downstreams] "
+                    "[-s packet-data-size] [-m megabytes]\n");
+            return 1;
+        }
+    }
+    if (ndownstreams < 1 || datalen < 1 || datalen > DOWNSTREAM_MAXPKT) {
+        fprintf(stderr, "testshare: need at least one downstream, and a "
+                "packet size from 1 to %d\n", DOWNSTREAM_MAXPKT);
+        return 1;
+    }
+    target <<= 20;
+
+    conf = conf_new();
+    conf_set_int(conf, CONF_protocol, PROT_SSH);
+    conf_set_bool(conf, CONF_ssh_connection_sharing, true);
+    conf_set_bool(conf, CONF_ssh_connection_sharing_upstream, true);
+    ssh_connection_sharing_init("bench.example", 22, conf, NULL, NULL, &state);
+    assert(state);
+    ssh_connshare_provide_connlayer(state, &fake_cl);
+    share_activate(state, "SSH-2.0-testshare");
+
+    downstreams = snewn(ndownstreams, FakeDownstream);
+    memset(downstreams, 0, ndownstreams * sizeof(*downstreams));
+    for (i = 0; i < ndownstreams; i++)
+        setup_downstream(i);
+
+    /*
+     * Prepare one data packet per downstream in each direction. From
+     * the server they're in the form ssh2connection.c hands to
+     * share_got_pkt_from_server; from downstream, they're on the
+     * wire, four at a time, as a socket read would deliver them.
+     */
+    from_server = snewn(ndownstreams, strbuf *);
+    from_downstream = snewn(ndownstreams, strbuf *);
+    payload = strbuf_new();
+    for (i = 0; i < ndownstreams; i++) {
+        from_server[i] = strbuf_new();
+        put_uint32(from_server[i], downstreams[i].upstream_id);
+        put_uint32(from_server[i], datalen);
+        memset(strbuf_append(from_server[i], datalen), 'x', datalen);
+
+        strbuf_clear(payload);
+        put_uint32(payload, downstreams[i].server_id);
+        put_uint32(payload, datalen);
+        memset(strbuf_append(payload, datalen), 'y', datalen);
+        from_downstream[i] = strbuf_new();
+        for (int j = 0; j < 4; j++)
+            downstream_packet(from_downstream[i], SSH2_MSG_CHANNEL_DATA,
+                              payload);
+    }
+    strbuf_free(payload);
+
+    npkts = target / datalen;
+    if (npkts < (unsigned long long)ndownstreams)
+        npkts = ndownstreams;
+
+    printf("%d downstreams, %d-byte packets, %lluMB each way\n",
+           ndownstreams, datalen, (npkts * datalen) >> 20);
+
+    start = clock();
+    for (n = 0; n < npkts; n++) {
+        FakeDownstream *ds = &downstreams[n % ndownstreams];
+        share_got_pkt_from_server(ds->cs, SSH2_MSG_CHANNEL_DATA,
+                                  from_server[ds->index]->s,
+                                  from_server[ds->index]->len);
+    }
+    t = elapsed(start);
+    printf("server -> downstream: %8.1f MB/s, %8.0f packets/s\n",
+           npkts * datalen / t / 1048576.0, npkts / t);
+
+    bytes_to_server = 0;
+    start = clock();
+    for (n = 0; n < npkts; n += 4) {
+        FakeDownstream *ds = &downstreams[(n / 4) % ndownstreams];
+        plug_receive(ds->plug, 0, from_downstream[ds->index]->s,
+                     from_downstream[ds->index]->len);
+    }
+    t = elapsed(start);
+    printf("downstream -> server: %8.1f MB/s, %8.0f packets/s\n",
+           n * datalen / t / 1048576.0, n / t);
+
+    for (i = 0; i < ndownstreams; i++) {
+        if (downstreams[i].bad) {
+            fprintf(stderr, "downstream %d received a packet with the "
+                    "wrong channel id\n", i);
+            status = 1;
+        }
+    }
+    if (bytes_to_server != n * (datalen + 8)) {
+        fprintf(stderr, "server received %llu bytes, expected %llu\n",
+                bytes_to_server, n * (datalen + 8));
+        status = 1;
+    }
+    if (bad_to_server) {
+        fprintf(stderr, "server received a packet with the wrong "
+                "channel id\n");
+        status = 1;
+    }
+
+    for (i = 0; i < ndownstreams; i++) {
+        strbuf_free(from_server[i]);
+        strbuf_free(from_downstream[i]);
+    }
+    sfree(from_server);
+    sfree(from_downstream);
+    strbuf_free(server_pktout);
+    sharestate_free(state);
+    sfree(downstreams);
+    conf_free(conf);
+    return status;
+}
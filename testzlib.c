@@ -8,14 +8,21 @@
  *
  * It's also useful as a means for a fuzzer to get reasonably direct
  * access to PuTTY's zlib decompressor.
+ *
+ * With -c it runs the compressor instead, and with -b it measures
+ * the ratio and speed of every compression level on a sample file,
+ * alongside PuTTY's LZ4-style method, and then again on the same file
+ * with bursts of random data mixed in.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "defs.h"
+#include "putty.h"
 #include "ssh.h"
 
 void out_of_memory(void)
@@ -29,12 +36,196 @@ void dputs(const char *buf)
     fputs(buf, stderr);
 }
 
+/*
+ * Size of the chunks in which -c and -b feed data to the compressor.
+ * SSH compresses each packet separately, so this approximates a
+ * stream of full-sized packets.
+ */
+#define CHUNK 16384
+
+static int compress_file(FILE *fp, int level)
+{
+    unsigned char buf[CHUNK], *outbuf;
+    int ret, outlen;
+    ssh_compressor *handle = ssh_compressor_new(&ssh_zlib, level);
+
+    while ((ret = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        ssh_compressor_compress(handle, buf, ret, &outbuf, &outlen, 0);
+        fwrite(outbuf, 1, outlen, stdout);
+        sfree(outbuf);
+    }
+
+    ssh_compressor_free(handle);
+    return 0;
+}
+
+static double elapsed(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static int benchmark_data(strbuf *input)
+{
+    unsigned char **couts, **douts;
+    int *clens, *dlens, run, status = 0;
+    size_t pos, nchunks, i;
+
+    nchunks = (input->len + CHUNK - 1) / CHUNK;
+    couts = snewn(nchunks, unsigned char *);
+    douts = snewn(nchunks, unsigned char *);
+    clens = snewn(nchunks, int);
+    dlens = snewn(nchunks, int);
+
+    printf("%d bytes of input, compressed in %d-byte chunks\n",
+           (int)input->len, CHUNK);
+    printf("method    output  ratio  compress MB/s  decompress MB/s\n");
+
+    /*
+     * Try every zlib level, and then the LZ4-style method for
+     * comparison.
+     */
+    for (run = 0; run <= ZLIB_MAX_LEVEL + 1; run++) {
+        const ssh_compression_alg *alg =
+            (run <= ZLIB_MAX_LEVEL ? &ssh_zlib : &ssh_lz4);
+        ssh_compressor *ch = ssh_compressor_new(alg, run);
+        ssh_decompressor *dh = ssh_decompressor_new(alg);
+        char label[16];
+        double ctime, dtime;
+        size_t total = 0;
+        bool ok = true;
+        clock_t start;
+
+        if (alg == &ssh_zlib)
+            sprintf(label, "zlib %d", run);
+        else
+            sprintf(label, "lz4");
+
+        /*
+         * Time compressing and decompressing the chunks one at a time,
+         * as an SSH connection would; keep the results until after
+         * the timing is over, to check them.
+         */
+        start = clock();
+        for (i = 0; i < nchunks; i++) {
+            size_t len = input->len - i * CHUNK;
+            if (len > CHUNK)
+                len = CHUNK;
+            ssh_compressor_compress(ch, input->u + i * CHUNK, len,
+                                    &couts[i], &clens[i], 0);
+        }
+        ctime = elapsed(start);
+
+        start = clock();
+        for (i = 0; i < nchunks; i++) {
+            if (!ssh_decompressor_decompress(dh, couts[i], clens[i],
+                                             &douts[i], &dlens[i])) {
+                douts[i] = NULL;
+                dlens[i] = 0;
+            }
+        }
+        dtime = elapsed(start);
+
+        for (i = pos = 0; i < nchunks; i++) {
+            if (!douts[i]) {
+                if (ok)
+                    fprintf(stderr, "%s: decoding error\n", label);
+                ok = false;
+            } else if (pos + dlens[i] > input->len ||
+                       memcmp(douts[i], input->u + pos, dlens[i])) {
+                if (ok)
+                    fprintf(stderr, "%s: round trip failed\n", label);
+                ok = false;
+            } else {
+                pos += dlens[i];
+            }
+            total += clens[i];
+            sfree(couts[i]);
+            sfree(douts[i]);
+        }
+        if (ok && pos != input->len) {
+            fprintf(stderr, "%s: round trip failed\n", label);
+            ok = false;
+        }
+        if (!ok)
+            status = 1;
+
+        printf("%-7s %8d %5.1f%% %14.1f %16.1f\n", label, (int)total,
+               100.0 * total / input->len,
+               input->len / 1048576.0 / (ctime > 0 ? ctime : 1e-9),
+               input->len / 1048576.0 / (dtime > 0 ? dtime : 1e-9));
+
+        ssh_compressor_free(ch);
+        ssh_decompressor_free(dh);
+    }
+
+    sfree(couts);
+    sfree(douts);
+    sfree(clens);
+    sfree(dlens);
+    return status;
+}
+
+/*
+ * Spacing of the bursts of random data that -b mixes into a second
+ * copy of its input. Not a multiple of CHUNK, so that the bursts
+ * start and end part way through chunks, as real ones would.
+ */
+#define MIX_SPACING 300000
+#define MIX_BURST 65536
+
+static int benchmark(FILE *fp)
+{
+    strbuf *input = strbuf_new_nm(), *mixed = strbuf_new_nm();
+    unsigned char buf[CHUNK];
+    unsigned long rng = 1;
+    size_t pos, spacing;
+    int ret, status;
+
+    while ((ret = fread(buf, 1, sizeof(buf), fp)) > 0)
+        put_data(input, buf, ret);
+    if (!input->len) {
+        fprintf(stderr, "no input data to benchmark with\n");
+        return 1;
+    }
+
+    status = benchmark_data(input);
+
+    /*
+     * Then the same data with bursts of random bytes scattered
+     * through it, as if it were a session that now and again
+     * transferred something already compressed. The random parts
+     * can't be compressed, but nor should they stop the rest being.
+     */
+    spacing = input->len / 2 < MIX_SPACING ? input->len / 2 : MIX_SPACING;
+    if (!spacing)
+        spacing = input->len;
+    for (pos = 0; pos < input->len; pos += spacing) {
+        size_t len = input->len - pos < spacing ? input->len - pos : spacing;
+        put_data(mixed, input->u + pos, len);
+        if (pos + len < input->len) {
+            for (size_t i = 0; i < MIX_BURST; i++) {
+                rng = (rng * 1103515245 + 12345) & 0xFFFFFFFF;
+                put_byte(mixed, rng >> 24);
+            }
+        }
+    }
+    printf("\nthe same with %d-byte bursts of random data every %d"
+           " bytes\n", MIX_BURST, (int)spacing);
+    status |= benchmark_data(mixed);
+
+    strbuf_free(input);
+    strbuf_free(mixed);
+    return status;
+}
+
 int main(int argc, char **argv)
 {
     unsigned char buf[16], *outbuf;
     int ret, outlen;
     ssh_decompressor *handle;
     int noheader = false, opts = true;
+    int complevel = -1;
+    bool bench = false;
     char *filename = NULL;
     FILE *fp;
 
@@ -44,6 +235,10 @@ int main(int argc, char **argv)
         if (p[0] == '-' && opts) {
             if (!strcmp(p, "-d")) {
                 noheader = true;
+            } else if (p[1] == 'c') {
+                complevel = (p[2] ? atoi(p + 2) : ZLIB_DEFAULT_LEVEL);
+            } else if (!strcmp(p, "-b")) {
+                bench = true;
             } else if (!strcmp(p, "--")) {
                 opts = false;          /* next thing is filename */
             } else if (!strcmp(p, "--help")) {
@@ -51,6 +246,10 @@ int main(int argc, char **argv)
                        " from standard input\n");
                 printf("       testzlib -d       decode Deflate (RFC1951) data"
                        " from standard input\n");
+                printf("       testzlib -c[N]    encode zlib data at level N"
+                       " (0-9) from standard input\n");
+                printf("       testzlib -b       benchmark every compression"
+                       " method and level\n");
                 printf("       testzlib --help   display this text\n");
                 return 0;
             } else {
@@ -65,6 +264,25 @@ int main(int argc, char **argv)
         }
     }
 
+    if (complevel >= 0 || bench) {
+        int status;
+
+        if (filename)
+            fp = fopen(filename, "rb");
+        else
+            fp = stdin;
+        if (!fp) {
+            fprintf(stderr, "unable to open '%s'\n", filename);
+            return 1;
+        }
+
+        status = bench ? benchmark(fp) : compress_file(fp, complevel);
+
+        if (filename)
+            fclose(fp);
+        return status;
+    }
+
     handle = ssh_decompressor_new(&ssh_zlib);
 
     if (noheader) {
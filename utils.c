@@ -406,10 +406,153 @@ char *dupprintf(const char *fmt, ...)
     return ret;
 }
 
+/* ----------------------------------------------------------------------
+ * Memory arenas. An arena is a list of chunks, and allocations are
+ * carved off the end of the first chunk until it's full. Each thread
+ * keeps a few spare chunks of the usual size, so that setting up and
+ * freeing an arena doesn't normally touch malloc at all.
+ */
+
+#define MEMARENA_CHUNK 4096     /* usual size of a chunk, header included */
+#define MEMARENA_ALIGN 16
+#define MEMARENA_SPARES 8       /* most spare chunks kept per thread */
+
+struct memarena_chunk {
+    struct memarena_chunk *next;
+    size_t size;                /* of the data area after the header */
+    size_t used;
+};
+
+#define MEMARENA_ROUND(n) \
+    (((n) + MEMARENA_ALIGN - 1) & ~(size_t)(MEMARENA_ALIGN - 1))
+#define MEMARENA_HDR MEMARENA_ROUND(sizeof(struct memarena_chunk))
+#define MEMARENA_DATA(c) ((char *)(c) + MEMARENA_HDR)
+
+struct memarena {
+    struct memarena_chunk *chunks;  /* allocations come from the first */
+    /* The most recent allocation, which can grow in place */
+    struct memarena_chunk *lastchunk;
+    char *last;
+};
+
+static THREAD_LOCAL struct {
+    struct memarena_chunk *head;
+    int n;
+} memarena_spares;
+
+static struct memarena_chunk *memarena_chunk_new(size_t size)
+{
+    struct memarena_chunk *c;
+
+    if (size <= MEMARENA_CHUNK - MEMARENA_HDR && memarena_spares.head) {
+        c = memarena_spares.head;
+        memarena_spares.head = c->next;
+        memarena_spares.n--;
+    } else {
+        size_t total;
+        assert(size <= ~(size_t)0 - MEMARENA_CHUNK);
+        total = max(MEMARENA_CHUNK, MEMARENA_HDR + size);
+        c = smalloc(total);
+        c->size = total - MEMARENA_HDR;
+    }
+    c->next = NULL;
+    c->used = 0;
+    return c;
+}
+
+memarena *memarena_new(void)
+{
+    struct memarena_chunk *c = memarena_chunk_new(sizeof(memarena));
+    memarena *ma = (memarena *)MEMARENA_DATA(c);
+
+    c->used = MEMARENA_ROUND(sizeof(memarena));
+    ma->chunks = c;
+    ma->lastchunk = NULL;
+    ma->last = NULL;
+    return ma;
+}
+
+void *memarena_alloc(memarena *ma, size_t size)
+{
+    struct memarena_chunk *c = ma->chunks;
+    char *toret;
+
+    assert(size <= ~(size_t)0 - MEMARENA_CHUNK);
+    size = MEMARENA_ROUND(size);
+
+    if (c->size - c->used < size) {
+        c = memarena_chunk_new(size);
+        if (size > (MEMARENA_CHUNK - MEMARENA_HDR) / 4) {
+            /*
+             * Something big gets a chunk of its own, behind the
+             * current one, which may still have plenty of room.
+             */
+            c->next = ma->chunks->next;
+            ma->chunks->next = c;
+        } else {
+            c->next = ma->chunks;
+            ma->chunks = c;
+        }
+    }
+
+    toret = MEMARENA_DATA(c) + c->used;
+    c->used += size;
+    ma->lastchunk = c;
+    ma->last = toret;
+    return toret;
+}
+
+/*
+ * Resize an allocation from an arena. The most recent one can usually
+ * be extended where it is; anything else is copied, and the old copy
+ * wiped.
+ */
+static void *memarena_realloc(memarena *ma, void *ptr, size_t oldsize,
+                              size_t newsize)
+{
+    struct memarena_chunk *c = ma->lastchunk;
+    char *toret;
+
+    if (ptr && ptr == ma->last) {
+        size_t offset = ma->last - MEMARENA_DATA(c);
+        if (newsize <= c->size - offset) {
+            c->used = offset + MEMARENA_ROUND(newsize);
+            return ptr;
+        }
+    }
+
+    toret = memarena_alloc(ma, newsize);
+    if (ptr) {
+        memcpy(toret, ptr, oldsize);
+        smemclr(ptr, oldsize);
+    }
+    return toret;
+}
+
+void memarena_free(memarena *ma)
+{
+    struct memarena_chunk *c, *next;
+
+    /* The chunk holding *ma itself is the last one in the list */
+    for (c = ma->chunks; c; c = next) {
+        next = c->next;
+        smemclr(MEMARENA_DATA(c), c->used);
+        if (c->size == MEMARENA_CHUNK - MEMARENA_HDR &&
+            memarena_spares.n < MEMARENA_SPARES) {
+            c->next = memarena_spares.head;
+            memarena_spares.head = c;
+            memarena_spares.n++;
+        } else {
+            sfree(c);
+        }
+    }
+}
+
 struct strbuf_impl {
     size_t size;
     struct strbuf visible;
     bool nm;          /* true if we insist on non-moving buffer resizes */
+    memarena *arena;  /* where the buffer lives, if not on the heap */
 };
 
 #define STRBUF_SET_UPTR(buf)                                    \
@@ -421,9 +564,21 @@ void *strbuf_append(strbuf *buf_o, size_t len)
 {
     struct strbuf_impl *buf = container_of(buf_o, struct strbuf_impl, visible);
     char *toret;
-    sgrowarray_general(
-        buf->visible.s, buf->size, buf->visible.len + 1, len, buf->nm);
-    STRBUF_SET_UPTR(buf);
+    if (buf->arena) {
+        if (len >= buf->size - buf->visible.len) {
+            size_t newsize;
+            assert(len < ~(size_t)0 / 2 - buf->size);
+            newsize = max(buf->size * 2, buf->visible.len + len + 1);
+            STRBUF_SET_PTR(buf, memarena_realloc(
+                               buf->arena, buf->visible.s,
+                               buf->visible.len + 1, newsize));
+            buf->size = newsize;
+        }
+    } else {
+        sgrowarray_general(
+            buf->visible.s, buf->size, buf->visible.len + 1, len, buf->nm);
+        STRBUF_SET_UPTR(buf);
+    }
     toret = buf->visible.s + buf->visible.len;
     buf->visible.len += len;
     buf->visible.s[buf->visible.len] = '\0';
@@ -467,15 +622,30 @@ static strbuf *strbuf_new_general(bool nm)
     buf->visible.len = 0;
     buf->size = 512;
     buf->nm = nm;
+    buf->arena = NULL;
     STRBUF_SET_PTR(buf, snewn(buf->size, char));
     *buf->visible.s = '\0';
     return &buf->visible;
 }
 strbuf *strbuf_new(void) { return strbuf_new_general(false); }
 strbuf *strbuf_new_nm(void) { return strbuf_new_general(true); }
+strbuf *strbuf_new_in(memarena *ma)
+{
+    struct strbuf_impl *buf = memarena_alloc(ma, sizeof(struct strbuf_impl));
+    BinarySink_INIT(&buf->visible, strbuf_BinarySink_write);
+    buf->visible.len = 0;
+    buf->size = 256;
+    buf->nm = true;
+    buf->arena = ma;
+    STRBUF_SET_PTR(buf, memarena_alloc(ma, buf->size));
+    *buf->visible.s = '\0';
+    return &buf->visible;
+}
 void strbuf_free(strbuf *buf_o)
 {
     struct strbuf_impl *buf = container_of(buf_o, struct strbuf_impl, visible);
+    if (buf->arena)
+        return;                        /* memarena_free will deal with it */
     if (buf->visible.s) {
         smemclr(buf->visible.s, buf->size);
         sfree(buf->visible.s);
@@ -485,13 +655,26 @@ void strbuf_free(strbuf *buf_o)
 char *strbuf_to_str(strbuf *buf_o)
 {
     struct strbuf_impl *buf = container_of(buf_o, struct strbuf_impl, visible);
-    char *ret = buf->visible.s;
+    char *ret;
+    if (buf->arena) {
+        ret = snewn(buf->visible.len + 1, char);
+        memcpy(ret, buf->visible.s, buf->visible.len + 1);
+        return ret;
+    }
+    ret = buf->visible.s;
     sfree(buf);
     return ret;
 }
 void strbuf_catfv(strbuf *buf_o, const char *fmt, va_list ap)
 {
     struct strbuf_impl *buf = container_of(buf_o, struct strbuf_impl, visible);
+    if (buf->arena) {
+        char *formatted = dupvprintf(fmt, ap);
+        size_t len = strlen(formatted);
+        memcpy(strbuf_append(buf_o, len), formatted, len);
+        burnstr(formatted);
+        return;
+    }
     STRBUF_SET_PTR(buf, dupvprintf_inner(buf->visible.s, buf->visible.len,
                                          &buf->size, fmt, ap));
     buf->visible.len += strlen(buf->visible.s + buf->visible.len);
@@ -517,6 +700,136 @@ void strbuf_finalise_agent_query(strbuf *buf_o)
     PUT_32BIT_MSB_FIRST(buf->visible.u, buf->visible.len - 4);
 }
 
+#if defined TEST_MEMARENA || defined TEST_BUFCHAIN
+/* Shared by the test code for memarenas and bufchains below */
+
+void out_of_memory(void) { fprintf(stderr, "out of memory\n"); exit(1); }
+
+/* Sizes run into the megabytes, so this needs 30 bits of output */
+static unsigned long test_rng_state = 1;
+static unsigned long test_rng(void)
+{
+    unsigned long r = 0;
+    for (int i = 0; i < 2; i++) {
+        test_rng_state = (test_rng_state * 1103515245 + 12345) & 0xFFFFFFFF;
+        r = (r << 15) | ((test_rng_state >> 16) & 0x7FFF);
+    }
+    return r;
+}
+
+static int fails;
+
+#define FAIL(...) do { printf(__VA_ARGS__); fails++; } while (0)
+
+#endif
+
+#ifdef TEST_MEMARENA
+
+/*
+ * Test code for memarenas and arena strbufs. Several strbufs are
+ * built at once in an arena, interleaving appends, formatted appends
+ * and shrinks between them (so that some grow in place and some have
+ * to move), alongside heap strbufs given the same operations, and
+ * they must end up the same. Plain allocations, big and small, are
+ * mixed in and checked for alignment and for not being overwritten.
+ *
+ *   cc -DTEST_MEMARENA -I. -Iunix -Icharset -o testmemarena utils.c \
+ *      memory.c marshal.c
+ */
+
+#define NBUFS 6
+#define NBLOCKS 64
+
+struct block {
+    unsigned char *p;
+    size_t len;
+    unsigned char fill;
+};
+
+static void random_round(void)
+{
+    memarena *ma = memarena_new();
+    strbuf *inarena[NBUFS], *onheap[NBUFS];
+    struct block blocks[NBLOCKS];
+    int nblocks = 0, nops = test_rng() % 400;
+    static unsigned char data[20000];
+
+    for (int i = 0; i < NBUFS; i++) {
+        inarena[i] = strbuf_new_in(ma);
+        onheap[i] = strbuf_new();
+    }
+
+    for (int op = 0; op < nops; op++) {
+        int i = test_rng() % NBUFS;
+        unsigned long r = test_rng() % 100;
+
+        if (r < 50) {
+            size_t len = (test_rng() % 8 == 0 ? test_rng() % 20000 :
+                          test_rng() % 100);
+            for (size_t j = 0; j < len; j++)
+                data[j] = test_rng();
+            put_data(inarena[i], data, len);
+            put_data(onheap[i], data, len);
+        } else if (r < 65) {
+            unsigned long x = test_rng();
+            strbuf_catf(inarena[i], "<%lu:%s>", x, "formatted");
+            strbuf_catf(onheap[i], "<%lu:%s>", x, "formatted");
+        } else if (r < 75) {
+            size_t len = onheap[i]->len ? test_rng() % onheap[i]->len : 0;
+            strbuf_shrink_to(inarena[i], len);
+            strbuf_shrink_to(onheap[i], len);
+        } else if (r < 80) {
+            /* Start this one again, leaving the old one in the arena */
+            strbuf_free(inarena[i]);
+            strbuf_free(onheap[i]);
+            inarena[i] = strbuf_new_in(ma);
+            onheap[i] = strbuf_new();
+        } else if (nblocks < NBLOCKS) {
+            struct block *b = &blocks[nblocks++];
+            b->len = (test_rng() % 4 == 0 ? test_rng() % 10000 :
+                      test_rng() % 64);
+            b->fill = test_rng();
+            b->p = memarena_alloc(ma, b->len);
+            if ((uintptr_t)b->p % 16)
+                FAIL("allocation of %zu bytes misaligned\n", b->len);
+            memset(b->p, b->fill, b->len);
+        }
+    }
+
+    for (int i = 0; i < NBUFS; i++) {
+        if (inarena[i]->len != onheap[i]->len ||
+            memcmp(inarena[i]->s, onheap[i]->s, onheap[i]->len + 1))
+            FAIL("strbuf %d differs from the heap version\n", i);
+
+        char *str = strbuf_to_str(inarena[i]);
+        if (memcmp(str, onheap[i]->s, onheap[i]->len + 1))
+            FAIL("strbuf_to_str of strbuf %d is wrong\n", i);
+        sfree(str);
+
+        strbuf_free(onheap[i]);
+    }
+
+    /* Nothing should have written over the plain allocations */
+    for (int k = 0; k < nblocks; k++)
+        for (size_t j = 0; j < blocks[k].len; j++)
+            if (blocks[k].p[j] != blocks[k].fill) {
+                FAIL("allocation %d was overwritten\n", k);
+                break;
+            }
+
+    memarena_free(ma);
+}
+
+int main(void)
+{
+    for (int round = 0; round < 2000 && !fails; round++)
+        random_round();
+    printf("%s\n", fails ? "tests failed" : "all tests passed");
+    return fails != 0 ? 1 : 0;
+}
+
+#endif /* TEST_MEMARENA */
+
 /*
  * Read an entire line of text from a file. Return a buffer
  * malloced to be as big as necessary (caller must free).
@@ -652,21 +965,156 @@ int base64_decode_atom(const char *atom, unsigned char *out)
  * smallish blocks, with the operations
  *
  *  - add an arbitrary amount of data to the end of the list
+ *  - add a bufslice to the end of the list without copying it
  *  - remove the first N bytes from the list
  *  - return a (pointer,length) pair giving some initial data in
  *    the list, suitable for passing to a send or write system
  *    call
+ *  - return several such pairs at once, covering successive
+ *    granules, for passing to a writev or sendmsg style call
  *  - retrieve a larger amount of initial data from the list
  *  - return the current size of the buffer chain in bytes
+ *
+ * Granules come in a few power-of-two sizes, and ones that are freed
+ * are kept in a per-thread pool for each size to be used again, so
+ * that a steady flow of data through a bufchain doesn't keep
+ * allocating and freeing memory. Adds too big for the largest size
+ * get a granule of their own, allocated and freed as usual.
  */
 
 #define BUFFER_MIN_GRANULE  512
+#define BUFCHAIN_NCLASSES 8     /* granules of 512 bytes up to 64K */
+#define BUFCHAIN_SLICE_CLASS BUFCHAIN_NCLASSES  /* header for a slice */
+#define BUFCHAIN_UNPOOLED (-1)
+#define BUFCHAIN_POOL_BYTES 262144      /* most to keep of each size */
 
 struct bufchain_granule {
     struct bufchain_granule *next;
     char *bufpos, *bufend, *bufmax;
+    int sizeclass;
+    bufslice *slice;           /* where the data is, if not in here */
+};
+
+struct bufslice {
+    const char *data;
+    size_t len;
+    int refcount;
+    void (*release)(void *ctx);
+    void *ctx;
 };
 
+struct bufchain_pool {
+    struct bufchain_granule *free[BUFCHAIN_NCLASSES + 1];
+    size_t nfree[BUFCHAIN_NCLASSES + 1];
+    struct bufchain_stats stats;
+};
+
+static THREAD_LOCAL struct bufchain_pool bufchain_pool;
+
+static inline size_t bufchain_class_size(int sizeclass)
+{
+    if (sizeclass == BUFCHAIN_SLICE_CLASS)
+        return sizeof(struct bufchain_granule);
+    return (size_t)BUFFER_MIN_GRANULE << sizeclass;
+}
+
+/*
+ * Make a granule with room for at least len bytes of data (or none,
+ * for a slice), from the pool if possible.
+ */
+static struct bufchain_granule *bufchain_granule_new(size_t len, bool slice)
+{
+    struct bufchain_pool *pool = &bufchain_pool;
+    struct bufchain_granule *g;
+    size_t need = sizeof(struct bufchain_granule) + len, grainlen;
+    int sizeclass;
+
+    if (slice) {
+        sizeclass = BUFCHAIN_SLICE_CLASS;
+    } else {
+        for (sizeclass = 0; sizeclass < BUFCHAIN_NCLASSES; sizeclass++)
+            if (need <= bufchain_class_size(sizeclass))
+                break;
+        if (sizeclass == BUFCHAIN_NCLASSES)
+            sizeclass = BUFCHAIN_UNPOOLED;
+    }
+
+    if (sizeclass != BUFCHAIN_UNPOOLED && pool->free[sizeclass]) {
+        g = pool->free[sizeclass];
+        pool->free[sizeclass] = g->next;
+        pool->nfree[sizeclass]--;
+        pool->stats.granules_reused++;
+        grainlen = bufchain_class_size(sizeclass);
+    } else {
+        grainlen = (sizeclass == BUFCHAIN_UNPOOLED ? need :
+                    bufchain_class_size(sizeclass));
+        g = smalloc(grainlen);
+        pool->stats.granules_allocated++;
+    }
+
+    g->next = NULL;
+    g->bufpos = g->bufend = (char *)g + sizeof(struct bufchain_granule);
+    g->bufmax = (char *)g + grainlen;
+    g->sizeclass = sizeclass;
+    g->slice = NULL;
+    return g;
+}
+
+static void bufchain_granule_free(struct bufchain_granule *g)
+{
+    struct bufchain_pool *pool = &bufchain_pool;
+    int sizeclass = g->sizeclass;
+
+    if (g->slice)
+        bufslice_unref(g->slice);
+
+    if (sizeclass != BUFCHAIN_UNPOOLED &&
+        pool->nfree[sizeclass] * bufchain_class_size(sizeclass) <
+        BUFCHAIN_POOL_BYTES) {
+        g->next = pool->free[sizeclass];
+        pool->free[sizeclass] = g;
+        pool->nfree[sizeclass]++;
+        pool->stats.granules_pooled++;
+    } else {
+        smemclr(g, sizeof(*g));
+        sfree(g);
+        pool->stats.granules_freed++;
+    }
+}
+
+void bufchain_get_stats(struct bufchain_stats *stats)
+{
+    *stats = bufchain_pool.stats;
+}
+
+bufslice *bufslice_new(const void *data, size_t len,
+                       void (*release)(void *ctx), void *ctx)
+{
+    bufslice *sl = snew(bufslice);
+    sl->data = (const char *)data;
+    sl->len = len;
+    sl->refcount = 1;
+    sl->release = release;
+    sl->ctx = ctx;
+    return sl;
+}
+
+bufslice *bufslice_ref(bufslice *sl)
+{
+    sl->refcount++;
+    return sl;
+}
+
+void bufslice_unref(bufslice *sl)
+{
+    assert(sl->refcount > 0);
+    if (--sl->refcount == 0) {
+        if (sl->release)
+            sl->release(sl->ctx);
+        sfree(sl);
+    }
+}
+
 static void uninitialised_queue_idempotent_callback(IdempotentCallback *ic)
 {
     unreachable("bufchain callback used while uninitialised");
@@ -686,8 +1134,7 @@ void bufchain_clear(bufchain *ch)
     while (ch->head) {
         b = ch->head;
         ch->head = ch->head->next;
-        smemclr(b, sizeof(*b));
-        sfree(b);
+        bufchain_granule_free(b);
     }
     ch->tail = NULL;
     ch->buffersize = 0;
@@ -706,6 +1153,16 @@ void bufchain_set_callback_inner(
     ch->ic = ic;
 }
 
+static void bufchain_append_granule(bufchain *ch,
+                                    struct bufchain_granule *g)
+{
+    if (ch->tail)
+        ch->tail->next = g;
+    else
+        ch->head = g;
+    ch->tail = g;
+}
+
 void bufchain_add(bufchain *ch, const void *data, size_t len)
 {
     const char *buf = (const char *)data;
@@ -713,6 +1170,7 @@ void bufchain_add(bufchain *ch, const void *data, size_t len)
     if (len == 0) return;
 
     ch->buffersize += len;
+    bufchain_pool.stats.bytes_copied += len;
 
     while (len > 0) {
         if (ch->tail && ch->tail->bufend < ch->tail->bufmax) {
@@ -722,27 +1180,38 @@ void bufchain_add(bufchain *ch, const void *data, size_t len)
             len -= copylen;
             ch->tail->bufend += copylen;
         }
-        if (len > 0) {
-            size_t grainlen =
-                max(sizeof(struct bufchain_granule) + len, BUFFER_MIN_GRANULE);
-            struct bufchain_granule *newbuf;
-            newbuf = smalloc(grainlen);
-            newbuf->bufpos = newbuf->bufend =
-                (char *)newbuf + sizeof(struct bufchain_granule);
-            newbuf->bufmax = (char *)newbuf + grainlen;
-            newbuf->next = NULL;
-            if (ch->tail)
-                ch->tail->next = newbuf;
-            else
-                ch->head = newbuf;
-            ch->tail = newbuf;
-        }
+        if (len > 0)
+            bufchain_append_granule(ch, bufchain_granule_new(len, false));
     }
 
     if (ch->ic)
         ch->queue_idempotent_callback(ch->ic);
 }
 
+void bufchain_add_slice(bufchain *ch, bufslice *sl, size_t offset, size_t len)
+{
+    struct bufchain_granule *g;
+
+    assert(offset <= sl->len && len <= sl->len - offset);
+    if (len == 0) return;
+
+    /*
+     * The granule's own data area is empty and can't be added to, so
+     * bufchain_add will start a new granule after it.
+     */
+    g = bufchain_granule_new(0, true);
+    g->slice = bufslice_ref(sl);
+    g->bufpos = (char *)sl->data + offset;
+    g->bufend = g->bufmax = g->bufpos + len;
+    bufchain_append_granule(ch, g);
+
+    ch->buffersize += len;
+    bufchain_pool.stats.bytes_sliced += len;
+
+    if (ch->ic)
+        ch->queue_idempotent_callback(ch->ic);
+}
+
 void bufchain_consume(bufchain *ch, size_t len)
 {
     struct bufchain_granule *tmp;
@@ -757,8 +1226,7 @@ void bufchain_consume(bufchain *ch, size_t len)
             ch->head = tmp->next;
             if (!ch->head)
                 ch->tail = NULL;
-            smemclr(tmp, sizeof(*tmp));
-            sfree(tmp);
+            bufchain_granule_free(tmp);
         } else
             ch->head->bufpos += remlen;
         ch->buffersize -= remlen;
@@ -771,6 +1239,26 @@ ptrlen bufchain_prefix(bufchain *ch)
     return make_ptrlen(ch->head->bufpos, ch->head->bufend - ch->head->bufpos);
 }
 
+size_t bufchain_prefixes(bufchain *ch, size_t skip, ptrlen *vec, size_t nvec)
+{
+    struct bufchain_granule *tmp;
+    size_t n = 0;
+
+    assert(ch->buffersize >= skip);
+
+    for (tmp = ch->head; tmp && n < nvec; tmp = tmp->next) {
+        size_t len = tmp->bufend - tmp->bufpos;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        vec[n++] = make_ptrlen(tmp->bufpos + skip, len - skip);
+        skip = 0;
+    }
+
+    return n;
+}
+
 void bufchain_fetch(bufchain *ch, void *data, size_t len)
 {
     struct bufchain_granule *tmp;
@@ -818,6 +1306,237 @@ size_t bufchain_fetch_consume_up_to(bufchain *ch, void *data, size_t len)
     return len;
 }
 
+#ifdef TEST_BUFCHAIN
+
+/*
+ * Test code for bufchains and bufslices. A random sequence of
+ * bufchain_add, bufchain_add_slice, bufchain_consume, bufchain_fetch
+ * and bufchain_prefixes is checked against a flat array holding what
+ * the bufchain ought to contain, and every slice is checked to have
+ * been released exactly once, and only after the last byte of it was
+ * consumed.
+ *
+ *   cc -DTEST_BUFCHAIN -I. -Iunix -Icharset -o testbufchain utils.c \
+ *      memory.c marshal.c
+ */
+
+#define MODEL_MAX (1 << 22)
+
+static unsigned char model[MODEL_MAX];
+static size_t modellen;
+static unsigned char pattern;
+static unsigned long long copied, sliced;
+
+/*
+ * Each slice records how much of it is still in the bufchain, so we
+ * can tell whether it was released at the right time.
+ */
+struct testslice {
+    unsigned char *data;
+    size_t len, outstanding;
+    bool released;
+};
+#define MAXSLICES 4096
+static struct testslice slices[MAXSLICES];
+static int nslices;
+
+/* For each byte of the model that came from a slice, which one */
+static short model_slice[MODEL_MAX];
+
+static void release_slice(void *ctx)
+{
+    struct testslice *ts = (struct testslice *)ctx;
+
+    if (ts->released)
+        FAIL("slice %d released twice\n", (int)(ts - slices));
+    if (ts->outstanding)
+        FAIL("slice %d released with %zu bytes still in use\n",
+             (int)(ts - slices), ts->outstanding);
+    ts->released = true;
+}
+
+static void fill(unsigned char *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        p[i] = pattern++;
+}
+
+static void do_add(bufchain *bc)
+{
+    static unsigned char buf[70000];
+    size_t len;
+
+    switch (test_rng() % 4) {
+      case 0: len = test_rng() % 16; break;
+      case 1: len = test_rng() % 600; break;
+      case 2: len = test_rng() % 5000; break;
+      default: len = test_rng() % 70000; break;
+    }
+    if (modellen + len > MODEL_MAX)
+        return;
+
+    fill(buf, len);
+    bufchain_add(bc, buf, len);
+    copied += len;
+    memcpy(model + modellen, buf, len);
+    for (size_t i = 0; i < len; i++)
+        model_slice[modellen + i] = -1;
+    modellen += len;
+}
+
+static void do_add_slice(bufchain *bc)
+{
+    struct testslice *ts;
+    bufslice *sl;
+    size_t len, offset, sublen;
+    int pieces;
+
+    if (nslices == MAXSLICES)
+        return;
+    len = 1 + test_rng() % 40000;
+    if (modellen + len > MODEL_MAX)
+        return;
+
+    ts = &slices[nslices];
+    ts->data = snewn(len, unsigned char);
+    ts->len = len;
+    ts->outstanding = 0;
+    ts->released = false;
+    fill(ts->data, len);
+    sl = bufslice_new(ts->data, len, release_slice, ts);
+
+    /* Add the slice in up to three pieces, possibly with gaps */
+    pieces = 1 + test_rng() % 3;
+    for (offset = 0; pieces-- > 0 && offset < len; offset += sublen) {
+        sublen = pieces ? test_rng() % (len - offset + 1) : len - offset;
+        if (test_rng() % 4 == 0) {
+            offset += sublen / 2;      /* skip some */
+            sublen -= sublen / 2;
+        }
+        bufchain_add_slice(bc, sl, offset, sublen);
+        sliced += sublen;
+        memcpy(model + modellen, ts->data + offset, sublen);
+        for (size_t i = 0; i < sublen; i++)
+            model_slice[modellen + i] = nslices;
+        modellen += sublen;
+        ts->outstanding += sublen;
+    }
+
+    nslices++;
+    bufslice_unref(sl);
+    if (!ts->outstanding && !ts->released)
+        FAIL("slice %d added nowhere, but not released\n", nslices - 1);
+}
+
+static void consume_model(size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        if (model_slice[i] >= 0)
+            slices[model_slice[i]].outstanding--;
+    memmove(model, model + len, modellen - len);
+    memmove(model_slice, model_slice + len,
+            (modellen - len) * sizeof(*model_slice));
+    modellen -= len;
+}
+
+static void do_consume(bufchain *bc)
+{
+    size_t len = modellen ? test_rng() % (modellen + 1) : 0;
+
+    if (test_rng() % 2) {
+        /* Not inside min(), which would call test_rng() twice */
+        size_t limit = test_rng() % 3000;
+        len = min(len, limit);
+    }
+    /* Update the model first, so a slice released here is accounted */
+    consume_model(len);
+    bufchain_consume(bc, len);
+}
+
+static void check_contents(bufchain *bc, unsigned long step)
+{
+    static unsigned char buf[MODEL_MAX];
+    ptrlen vec[8];
+    size_t skip, n, total;
+
+    if (bufchain_size(bc) != modellen) {
+        FAIL("step %lu: size %zu, expected %zu\n",
+             step, bufchain_size(bc), modellen);
+        return;
+    }
+
+    bufchain_fetch(bc, buf, modellen);
+    if (memcmp(buf, model, modellen))
+        FAIL("step %lu: bufchain_fetch gave the wrong data\n", step);
+
+    skip = modellen ? test_rng() % modellen : 0;
+    n = bufchain_prefixes(bc, skip, vec, lenof(vec));
+    total = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (memcmp(vec[i].ptr, model + skip + total, vec[i].len))
+            FAIL("step %lu: bufchain_prefixes gave the wrong data\n", step);
+        total += vec[i].len;
+    }
+    if (n < lenof(vec) && total != modellen - skip)
+        FAIL("step %lu: bufchain_prefixes covered %zu bytes, not %zu\n",
+             step, total, modellen - skip);
+}
+
+static void random_test(unsigned long steps)
+{
+    struct bufchain_stats before, after;
+    bufchain bc;
+
+    bufchain_get_stats(&before);
+    bufchain_init(&bc);
+
+    for (unsigned long step = 0; step < steps && !fails; step++) {
+        unsigned long r = test_rng() % 100;
+
+        if (r < 40)
+            do_add(&bc);
+        else if (r < 55)
+            do_add_slice(&bc);
+        else
+            do_consume(&bc);
+
+        if (step % 16 == 0)
+            check_contents(&bc, step);
+    }
+
+    /* Clearing must release everything still in there */
+    consume_model(modellen);
+    bufchain_clear(&bc);
+
+    /* ... and hand back every granule it took */
+    bufchain_get_stats(&after);
+    if (after.bytes_copied - before.bytes_copied != copied ||
+        after.bytes_sliced - before.bytes_sliced != sliced)
+        FAIL("stats say %llu bytes copied and %llu sliced, not %llu "
+             "and %llu\n", after.bytes_copied - before.bytes_copied,
+             after.bytes_sliced - before.bytes_sliced, copied, sliced);
+    if (after.granules_allocated - before.granules_allocated +
+        after.granules_reused - before.granules_reused !=
+        after.granules_pooled - before.granules_pooled +
+        after.granules_freed - before.granules_freed)
+        FAIL("granules taken and given back don't match\n");
+
+    for (int i = 0; i < nslices; i++) {
+        if (!slices[i].released)
+            FAIL("slice %d never released\n", i);
+        sfree(slices[i].data);
+    }
+}
+
+int main(void)
+{
+    random_test(200000);
+    printf("%s\n", fails ? "tests failed" : "all tests passed");
+    return fails != 0 ? 1 : 0;
+}
+
+#endif /* TEST_BUFCHAIN */
+
 /* ----------------------------------------------------------------------
  * Debugging routines.
  */